@@ -0,0 +1,79 @@
+#ifndef BOARD_H
+#define BOARD_H
+
+#include <Arduino.h>
+
+// Board profiles describe where things are wired: pins, active levels and how much current an output pulls
+// when switched on. Pick one with a BOARD_* build flag in platformio.ini, the Nano relay module is the default.
+// Everything is resolved at compile time, outputs are types and switching one is a single port write.
+
+// Switching many high inrush loads at once can trip a breaker or brown out the board, those are staggered.
+enum Inrush {
+  INRUSH_NONE, // LEDs, signals
+  INRUSH_LOW,  // valves and solenoids
+  INRUSH_HIGH, // motors and heaters
+};
+
+// Write a pin known at compile time.
+// On the ATmega328P Arduino pins map linearly to ports, so this becomes a single sbi/cbi instruction.
+// Mind that unlike digitalWrite() it doesn't stop PWM on the pin, outputs are never used with analogWrite().
+template <unsigned char PIN>
+inline void writePin(unsigned char level) {
+#if defined(__AVR_ATmega328P__)
+  static_assert(PIN < 20, "Pin not available on the ATmega328P");
+  volatile uint8_t &port = PIN < 8 ? PORTD : (PIN < 14 ? PORTB : PORTC);
+  const uint8_t mask = 1 << (PIN < 8 ? PIN : (PIN < 14 ? PIN - 8 : PIN - 14));
+  if (level) {
+    port |= mask;
+  } else {
+    port &= ~mask;
+  }
+#else
+  digitalWrite(PIN, level);
+#endif
+}
+
+#define NO_FEEDBACK 0xFF
+
+// An output wired to PIN, on when the pin is at ACTIVE level.
+// Relays with an auxiliary contact can report their real state on a FEEDBACK pin, pulled to ground while energized.
+template <unsigned char PIN, unsigned char ACTIVE, Inrush INRUSH, unsigned char FEEDBACK = NO_FEEDBACK>
+struct Output {
+  static const unsigned char pin = PIN;
+  static const unsigned char active = ACTIVE;
+  static const Inrush inrush = INRUSH;
+  static const unsigned char feedback = FEEDBACK;
+
+  // Off level is set before enabling the output, so relays don't click at boot.
+  static void setup() {
+    off();
+    pinMode(PIN, OUTPUT);
+    if (FEEDBACK != NO_FEEDBACK) {
+      pinMode(FEEDBACK, INPUT_PULLUP);
+    }
+  }
+
+  static bool hasFeedback() { return FEEDBACK != NO_FEEDBACK; }
+
+  // Real state of the relay, only meaningful when hasFeedback().
+  static bool isEnergized() { return FEEDBACK != NO_FEEDBACK && !digitalRead(FEEDBACK); }
+
+  // Commanded state, read back from the output latch.
+  static bool isOn() { return digitalRead(PIN) == ACTIVE; }
+
+  static void on() { writePin<PIN>(ACTIVE); }
+  static void off() { writePin<PIN>(!ACTIVE); }
+  static void set(bool enabled) { writePin<PIN>(enabled ? ACTIVE : !ACTIVE); }
+};
+
+#if defined(BOARD_MEGA_RELAY_MODULE)
+#include "boards/mega_relay_module.h"
+#elif defined(BOARD_PICO_RELAY_MODULE)
+#include "boards/pico_relay_module.h"
+#elif defined(BOARD_SIM)
+#include "boards/sim.h"
+#else
+#include "boards/nano_relay_module.h"
+#endif
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef BOARDS_MEGA_RELAY_MODULE_H
+#define BOARDS_MEGA_RELAY_MODULE_H
+
+// Arduino Mega 2560 with the same relay module as the Nano.
+// Level sensor and main switch sit on external interrupt pins, so no pin change vectors are needed.
+
+#define RELAY_MODULE_ON LOW
+
+typedef Output<22, RELAY_MODULE_ON, INRUSH_HIGH> WaterLoadRelay;
+typedef Output<23, RELAY_MODULE_ON, INRUSH_HIGH> MainPumpRelay;
+typedef Output<24, RELAY_MODULE_ON, INRUSH_HIGH> DrainRelay;
+typedef Output<25, RELAY_MODULE_ON, INRUSH_LOW> SoapRelay;
+typedef Output<26, HIGH, INRUSH_HIGH> HeaterRelay;
+typedef Output<12, LOW, INRUSH_NONE> StatusLed;
+
+// Optional rinse aid dispenser with its own solenoid, on an extra relay.
+// typedef Output<29, HIGH, INRUSH_LOW> RinseAidRelay;
+// #define HAS_RINSE_AID_RELAY
+
+// Optional vent fan or flap, see the Nano profile.
+// typedef Output<27, HIGH, INRUSH_LOW> VentRelay;
+// #define HAS_VENT_RELAY
+
+#define WATER_DISABLED_PIN 2
+#define TEMP_SENSOR A0
+
+// Optional pressure transducer, see the Nano profile.
+// #define LEVEL_SENSOR_PIN A1
+// #define LEVEL_CALIBRATION { { 41, 0 }, { 222, 1000 }, { 312, 5000 } }
+// #define LEVEL_SWITCH_MILLILITRES 1500
+// With the level sensor, light loads are detected once the load estimate is measured on the machine (see load.h):
+// the heat_rate and top_up_percent telemetry of the pre-wash, empty and with a light and a full load.
+// #define EMPTY_HEATING_RATE 0.136f // centigrades per second, heat_rate / 60 when empty
+// #define LIGHT_LOAD_HEATING_PERCENT 87
+// #define LIGHT_LOAD_TOP_UP_PERCENT 30
+
+// Optional current sensors, see the Nano profile.
+// #define HEATER_CURRENT_PIN A2
+// #define HEATER_CURRENT_MV_PER_A 100
+// #define MAIN_PUMP_CURRENT_PIN A3
+// #define MAIN_PUMP_CURRENT_MV_PER_A 185
+// #define DRAIN_CURRENT_PIN A4
+// #define DRAIN_CURRENT_MV_PER_A 185
+
+#define SPEAKER_PIN 11
+#define SWITCH_PIN 3
+
+// Aquastop float switch, closes to ground on water.
+#define LEAK_SENSOR_PIN 18
+
+// Door switch, closes to ground with the door shut.
+#define DOOR_SWITCH_PIN 19
+
+// Optional RS-485 bus for Modbus and heater power (see modbus.h and powerbus.h): a transceiver on Serial2,
+// D28 drives its DE and RE pins. Every machine on the bus needs its own address.
+// #define RS485_SERIAL Serial2
+// #define RS485_DE_PIN 28
+// #define RS485_ADDRESS 1
+// #define HEATER_WATTS 2000
+
+// Plenty of RAM and UARTs, telemetry on the USB serial port.
+#define TELEMETRY_SERIAL Serial
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef BOARDS_NANO_RELAY_MODULE_H
+#define BOARDS_NANO_RELAY_MODULE_H
+
+// Arduino Nano with a 4 channel active low relay module and a separate heater relay.
+
+// Relays: 
+//  1 - Water pump (WATER_LOAD_PIN)
+//  2 - Main pump
+//  3 - Drain pump
+//  4 - Dispenser
+//  H - Heater
+#define RELAY_MODULE_ON LOW
+
+typedef Output<6, RELAY_MODULE_ON, INRUSH_HIGH> WaterLoadRelay;
+typedef Output<7, RELAY_MODULE_ON, INRUSH_HIGH> MainPumpRelay;
+typedef Output<4, RELAY_MODULE_ON, INRUSH_HIGH> DrainRelay;
+typedef Output<3, RELAY_MODULE_ON, INRUSH_LOW> SoapRelay;
+typedef Output<8, HIGH, INRUSH_HIGH> HeaterRelay;
+typedef Output<12, LOW, INRUSH_NONE> StatusLed;
+
+// Rinse aid needs a dispenser with its own solenoid and a relay for it. Every spare pin of the Nano is taken by
+// the optional outputs and sensors below, so rinse aid steps run without it here.
+
+// Optional vent fan or flap, run now and then while drying. D9 on an extra relay.
+// typedef Output<9, HIGH, INRUSH_LOW> VentRelay;
+// #define HAS_VENT_RELAY
+
+#define WATER_DISABLED_PIN 5
+#define TEMP_SENSOR A5
+
+// Optional pressure transducer on a spare analog input, for a continuous water level.
+// LEVEL_CALIBRATION holds {reading, millilitres} points measured on the machine, see level.h,
+// LEVEL_SWITCH_MILLILITRES the volume the level switch closes at, the fill checks the two agree.
+// #define LEVEL_SENSOR_PIN A0
+// #define LEVEL_CALIBRATION { { 41, 0 }, { 222, 1000 }, { 312, 5000 } }
+// #define LEVEL_SWITCH_MILLILITRES 1500
+// With the level sensor, light loads are detected once the load estimate is measured on the machine (see load.h):
+// the heat_rate and top_up_percent telemetry of the pre-wash, empty and with a light and a full load.
+// #define EMPTY_HEATING_RATE 0.136f // centigrades per second, heat_rate / 60 when empty
+// #define LIGHT_LOAD_HEATING_PERCENT 87
+// #define LIGHT_LOAD_TOP_UP_PERCENT 30
+
+// Optional ACS712 current sensors on the heater and pumps, analog pin and sensitivity in mV/A, see current.h.
+// #define HEATER_CURRENT_PIN A1
+// #define HEATER_CURRENT_MV_PER_A 100
+// #define MAIN_PUMP_CURRENT_PIN A2
+// #define MAIN_PUMP_CURRENT_MV_PER_A 185
+// #define DRAIN_CURRENT_PIN A3
+// #define DRAIN_CURRENT_MV_PER_A 185
+
+#define SPEAKER_PIN 11
+#define SWITCH_PIN 10
+
+// Aquastop float switch in the base pan, closes to ground on water. D2 is INT0, the fastest interrupt there is.
+#define LEAK_SENSOR_PIN 2
+
+// Door switch, closes to ground with the door shut.
+#define DOOR_SWITCH_PIN A4
+
+// Optional RS-485 bus for Modbus and heater power (see modbus.h and powerbus.h): a transceiver on the serial port,
+// D13 drives its DE and RE pins. Every machine on the bus needs its own address.
+// #define RS485_SERIAL Serial
+// #define RS485_DE_PIN 13
+// #define RS485_ADDRESS 1
+// #define HEATER_WATTS 2000
+
+// Pin change interrupt vectors are per port: WATER_DISABLED_PIN (D5) is on port D, SWITCH_PIN (D10) on port B.
+#define WATER_DISABLED_PCINT_vect PCINT2_vect
+#define SWITCH_PCINT_vect PCINT0_vect
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef BOARDS_PICO_RELAY_MODULE_H
+#define BOARDS_PICO_RELAY_MODULE_H
+
+// Raspberry Pi Pico (RP2040) with the same relay module as the Nano.
+// Mind the 3.3V logic: the relay module needs its JD-VCC jumper removed and 5V on JD-VCC,
+// and the thermistor divider must be fed from 3.3V so readings keep the same scale.
+
+#define RELAY_MODULE_ON LOW
+
+typedef Output<2, RELAY_MODULE_ON, INRUSH_HIGH> WaterLoadRelay;
+typedef Output<3, RELAY_MODULE_ON, INRUSH_HIGH> MainPumpRelay;
+typedef Output<4, RELAY_MODULE_ON, INRUSH_HIGH> DrainRelay;
+typedef Output<5, RELAY_MODULE_ON, INRUSH_LOW> SoapRelay;
+typedef Output<6, HIGH, INRUSH_HIGH> HeaterRelay;
+typedef Output<7, LOW, INRUSH_NONE> StatusLed;
+
+// Optional rinse aid dispenser, see the Mega profile.
+// typedef Output<9, HIGH, INRUSH_LOW> RinseAidRelay;
+// #define HAS_RINSE_AID_RELAY
+
+// Optional vent fan or flap, see the Nano profile.
+// typedef Output<8, HIGH, INRUSH_LOW> VentRelay;
+// #define HAS_VENT_RELAY
+
+#define WATER_DISABLED_PIN 10
+#define TEMP_SENSOR A0
+
+// Optional pressure transducer, see the Nano profile.
+// A 5V transducer needs a divider down to 3.3V, calibrate the readings after it.
+// #define LEVEL_SENSOR_PIN A1
+// #define LEVEL_CALIBRATION { { 41, 0 }, { 222, 1000 }, { 312, 5000 } }
+// #define LEVEL_SWITCH_MILLILITRES 1500
+// With the level sensor, light loads are detected once the load estimate is measured on the machine (see load.h):
+// the heat_rate and top_up_percent telemetry of the pre-wash, empty and with a light and a full load.
+// #define EMPTY_HEATING_RATE 0.136f // centigrades per second, heat_rate / 60 when empty
+// #define LIGHT_LOAD_HEATING_PERCENT 87
+// #define LIGHT_LOAD_TOP_UP_PERCENT 30
+
+// Optional current sensor on the heater, see the Nano profile. The pumps would need an external ADC,
+// the RP2040 has three analog inputs only. Mind the sensor output must be divided down to 3.3V.
+// #define HEATER_CURRENT_PIN A2
+// #define HEATER_CURRENT_MV_PER_A 66
+// #define CURRENT_SENSOR_REFERENCE_MV 3300UL
+
+#define SPEAKER_PIN 11
+#define SWITCH_PIN 12
+
+// Aquastop float switch, closes to ground on water.
+#define LEAK_SENSOR_PIN 13
+
+// Door switch, closes to ground with the door shut.
+#define DOOR_SWITCH_PIN 14
+
+// Optional RS-485 bus for Modbus and heater power (see modbus.h and powerbus.h): a transceiver on Serial1
+// (GP0 and GP1), GP15 drives its DE and RE pins. Every machine on the bus needs its own address.
+// #define RS485_SERIAL Serial1
+// #define RS485_DE_PIN 15
+// #define RS485_ADDRESS 1
+// #define HEATER_WATTS 2000
+
+// Telemetry on the USB serial port.
+#define TELEMETRY_SERIAL Serial
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef BOARDS_SIM_H
+#define BOARDS_SIM_H
+
+// Host simulator, same wiring as the Nano relay module. Inputs use attachInterrupt().
+
+#define RELAY_MODULE_ON LOW
+
+typedef Output<6, RELAY_MODULE_ON, INRUSH_HIGH> WaterLoadRelay;
+typedef Output<7, RELAY_MODULE_ON, INRUSH_HIGH> MainPumpRelay;
+typedef Output<4, RELAY_MODULE_ON, INRUSH_HIGH> DrainRelay;
+typedef Output<3, RELAY_MODULE_ON, INRUSH_LOW> SoapRelay;
+typedef Output<8, HIGH, INRUSH_HIGH> HeaterRelay;
+typedef Output<12, LOW, INRUSH_NONE> StatusLed;
+
+// Rinse aid dispenser.
+typedef Output<13, RELAY_MODULE_ON, INRUSH_LOW> RinseAidRelay;
+#define HAS_RINSE_AID_RELAY
+
+// Drying vent fan.
+typedef Output<9, RELAY_MODULE_ON, INRUSH_LOW> VentRelay;
+#define HAS_VENT_RELAY
+
+#define WATER_DISABLED_PIN 5
+#define TEMP_SENSOR A5
+
+// Pressure transducer (MPX5010 like) in the sump, a 1 liter sump under a 400 cm2 tub.
+// Build with SIM_NO_LEVEL_SENSOR to run on the level switch alone, like the Nano.
+#ifndef SIM_NO_LEVEL_SENSOR
+#define LEVEL_SENSOR_PIN A0
+#define LEVEL_CALIBRATION { { 41, 0 }, { 222, 1000 }, { 312, 5000 } }
+#define LEVEL_SWITCH_MILLILITRES 1500
+
+// Load estimate, see load.h. Fitted to the simulator's plant rather than measured on a machine: empty it heats
+// at 8.2 C/min, 1.5 kg of dishes at 91% of that and 2 kg at 88%, topping up in 29% and 31% of loadTime.
+#define EMPTY_HEATING_RATE 0.136f // centigrades per second, full level and no dishes
+#define LIGHT_LOAD_HEATING_PERCENT 87
+#define LIGHT_LOAD_TOP_UP_PERCENT 30
+#endif
+
+// ACS712 current sensors: 20A part on the heater, 5A ones on the pumps.
+#define HEATER_CURRENT_PIN A1
+#define HEATER_CURRENT_MV_PER_A 100
+#define MAIN_PUMP_CURRENT_PIN A2
+#define MAIN_PUMP_CURRENT_MV_PER_A 185
+#define DRAIN_CURRENT_PIN A3
+#define DRAIN_CURRENT_MV_PER_A 185
+
+#define SPEAKER_PIN 11
+#define SWITCH_PIN 10
+#define LEAK_SENSOR_PIN 2
+#define DOOR_SWITCH_PIN A4
+
+// RS-485 bus (Modbus and heater power) on a pseudo terminal, see --bus.
+#define RS485_SERIAL Serial1
+#define RS485_DE_PIN 20
+#define RS485_ADDRESS simBusAddress()
+
+// Telemetry lines go to stdout, mixed with the simulator output.
+#define TELEMETRY_SERIAL Serial
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef CURRENT_H
+#define CURRENT_H
+
+#include <Arduino.h>
+#include "duration.h"
+#include "timer.h"
+
+// AC current through a hall effect sensor (ACS712 like), its output sits at half the supply with no current.
+// Mains current is a sine, so the sensor is sampled as often as possible and the peak to peak reading
+// over a couple of mains cycles gives the amplitude. Reads 0 until the first window is complete.
+#ifndef CURRENT_SENSOR_REFERENCE_MV
+#define CURRENT_SENSOR_REFERENCE_MV 5000UL // ADC full scale
+#endif
+
+constexpr Milliseconds CURRENT_WINDOW(40); // two cycles at 50 Hz, more than two at 60 Hz
+
+class CurrentSensor {
+ public:
+  // mvPerAmp is the sensor sensitivity: 185 for the 5A ACS712, 100 for the 20A one and 66 for the 30A one.
+  CurrentSensor(unsigned char pin, unsigned int mvPerAmp)
+      : pin(pin), mvPerAmp(mvPerAmp), lowest(1023), highest(0), peakToPeak(0) {}
+
+  void sample() {
+    int reading = analogRead(pin);
+    lowest = reading < lowest ? reading : lowest;
+    highest = reading > highest ? reading : highest;
+    if (window.hasElapsed(CURRENT_WINDOW)) {
+      peakToPeak = highest - lowest;
+      lowest = 1023;
+      highest = 0;
+      window.restart();
+    }
+  }
+
+  // RMS current of the last complete window.
+  unsigned long milliamps() const {
+    unsigned long millivolts = peakToPeak * CURRENT_SENSOR_REFERENCE_MV / 1023;
+    return millivolts * 1000 / mvPerAmp / 2 * 1000 / 1414;
+  }
+
+ private:
+  unsigned char pin;
+  unsigned int mvPerAmp;
+  int lowest;
+  int highest;
+  int peakToPeak;
+  Timer window;
+};
+
+#endif
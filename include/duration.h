@@ -0,0 +1,84 @@
+#ifndef DURATION_H
+#define DURATION_H
+
+#include <Arduino.h>
+
+// Strongly typed durations.
+// The unit is part of the type (milliseconds per unit), so minutes can't be compared with milliseconds by mistake.
+// Conversions are constexpr and saturate instead of overflowing, a saturated duration just means "forever".
+template <unsigned long MS_PER_UNIT>
+class Duration {
+ public:
+  constexpr explicit Duration(unsigned long count = 0) : value(count) {}
+
+  constexpr unsigned long count() const { return value; }
+
+  // Same duration in milliseconds, saturated at the unsigned long limit.
+  constexpr unsigned long toMillis() const {
+    return value > 0xFFFFFFFFUL / MS_PER_UNIT ? 0xFFFFFFFFUL : value * MS_PER_UNIT;
+  }
+
+  // True when the duration can be expressed in milliseconds without saturating.
+  constexpr bool fitsInMillis() const { return value <= 0xFFFFFFFFUL / MS_PER_UNIT; }
+
+ private:
+  unsigned long value;
+};
+
+typedef Duration<1> Milliseconds;
+typedef Duration<1000> Seconds;
+typedef Duration<60000> Minutes;
+
+// Any unit can be turned into milliseconds, the common unit used for arithmetic and comparisons.
+template <unsigned long U>
+constexpr Milliseconds toMillis(Duration<U> d) {
+  return Milliseconds(d.toMillis());
+}
+
+template <unsigned long A, unsigned long B>
+constexpr bool operator<(Duration<A> a, Duration<B> b) { return a.toMillis() < b.toMillis(); }
+template <unsigned long A, unsigned long B>
+constexpr bool operator>(Duration<A> a, Duration<B> b) { return a.toMillis() > b.toMillis(); }
+template <unsigned long A, unsigned long B>
+constexpr bool operator<=(Duration<A> a, Duration<B> b) { return a.toMillis() <= b.toMillis(); }
+template <unsigned long A, unsigned long B>
+constexpr bool operator>=(Duration<A> a, Duration<B> b) { return a.toMillis() >= b.toMillis(); }
+
+// Saturating sum, in milliseconds.
+template <unsigned long A, unsigned long B>
+constexpr Milliseconds operator+(Duration<A> a, Duration<B> b) {
+  return Milliseconds(a.toMillis() > 0xFFFFFFFFUL - b.toMillis() ? 0xFFFFFFFFUL : a.toMillis() + b.toMillis());
+}
+
+template <unsigned long U>
+constexpr Duration<U> operator/(Duration<U> d, unsigned long divisor) {
+  return Duration<U>(d.count() / divisor);
+}
+
+// A point in time as returned by millis().
+// There is no way to compare two timestamps directly: millis() rolls over every ~49 days,
+// only the unsigned difference between them is meaningful.
+// Kept in 32 bits whatever the size of unsigned long, so differences wrap the same on the host as on the boards.
+class Timestamp {
+ public:
+  constexpr explicit Timestamp(uint32_t ms = 0) : value(ms) {}
+
+  static Timestamp now() { return Timestamp(millis()); }
+
+  // Time since this timestamp, correct across a millis() rollover.
+  Milliseconds elapsed() const { return Milliseconds((uint32_t)((uint32_t)millis() - value)); }
+
+  template <unsigned long U>
+  bool hasElapsed(Duration<U> d) const { return elapsed() >= d; }
+
+  // Time from origin to this timestamp.
+  Milliseconds elapsedSince(Timestamp origin) const { return Milliseconds((uint32_t)(value - origin.value)); }
+
+  // Timestamp that was d before this one.
+  Timestamp operator-(Milliseconds d) const { return Timestamp(value - (uint32_t)d.count()); }
+
+ private:
+  uint32_t value;
+};
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+#include <Arduino.h>
+#ifdef ARDUINO_ARCH_RP2040
+#include <hardware/sync.h>
+#endif
+
+// Things the program engine reacts to.
+enum EventType {
+  EVENT_NONE,
+  EVENT_LEVEL_CHANGED,       // value: raw WATER_DISABLED_PIN state, confirm with isLoaded()
+  EVENT_TEMPERATURE_CROSSED, // value: thermistor reading that crossed the watched threshold
+  EVENT_SWITCH,              // value: 1 pressed, 0 released
+  EVENT_TIMER_EXPIRED,       // nothing happened before the wait timed out
+  EVENT_LEAK,                // the leak sensor sees water, inlet and heater are already off
+  EVENT_START,               // value: program number asked for by a host tool, see PROGRAMS
+};
+
+struct Event {
+  unsigned char type;
+  int value;
+};
+
+// Keeps interrupts off for the lifetime of the object and restores the previous state afterwards,
+// so it can be used both from the main loop and from inside an ISR.
+class CriticalSection {
+ public:
+#ifdef __AVR__
+  CriticalSection() : sreg(SREG) { cli(); }
+  ~CriticalSection() { SREG = sreg; }
+
+ private:
+  unsigned char sreg;
+#elif defined(ARDUINO_ARCH_RP2040)
+  CriticalSection() : status(save_and_disable_interrupts()) {}
+  ~CriticalSection() { restore_interrupts(status); }
+
+ private:
+  uint32_t status;
+#else
+  // Only the simulator gets here, its interrupts are no-ops.
+  CriticalSection() { noInterrupts(); }
+  ~CriticalSection() { interrupts(); }
+#endif
+};
+
+// Fixed capacity event queue, safe to push from interrupts.
+// When full the oldest event is dropped: events carry state, the newest one is the one that matters.
+template <unsigned char CAPACITY>
+class EventQueue {
+  static_assert(CAPACITY > 0 && (CAPACITY & (CAPACITY - 1)) == 0, "EventQueue CAPACITY must be a power of two");
+
+ public:
+  EventQueue() : head(0), count(0), dropped(0) {}
+
+  void push(unsigned char type, int value = 0) {
+    CriticalSection lock;
+    if (count == CAPACITY) {
+      head = (head + 1) & (CAPACITY - 1);
+      count--;
+      dropped++;
+    }
+    Event &event = items[(head + count) & (CAPACITY - 1)];
+    event.type = type;
+    event.value = value;
+    count++;
+  }
+
+  bool pop(Event &event) {
+    CriticalSection lock;
+    if (count == 0) {
+      return false;
+    }
+    event.type = items[head].type;
+    event.value = items[head].value;
+    head = (head + 1) & (CAPACITY - 1);
+    count--;
+    return true;
+  }
+
+  bool isEmpty() const { return count == 0; }
+
+  // Number of events lost because the queue was full.
+  unsigned char droppedCount() const { return dropped; }
+
+ private:
+  Event items[CAPACITY];
+  volatile unsigned char head;
+  volatile unsigned char count;
+  volatile unsigned char dropped;
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef HAL_H
+#define HAL_H
+
+// The few things that differ between the boards and the host simulator.
+// Everything else goes through the Arduino API and the board profile.
+
+// Called from interrupts whenever the level sensor or the main switch change, defined by the controller.
+void onLevelChange();
+void onSwitchChange();
+
+// Called from an interrupt as soon as the leak sensor sees water.
+void onLeak();
+
+// Route level sensor, main switch and leak sensor changes to onLevelChange(), onSwitchChange() and onLeak().
+void halSetupInterrupts();
+
+// Idle the CPU until the next interrupt, for a millisecond at most.
+void halIdle();
+
+#endif
@@ -0,0 +1,147 @@
+#ifndef HSM_H
+#define HSM_H
+
+// Compact hierarchical state machine.
+// States are described by a constant table (kept in flash on AVR), the machine itself only stores the current state.
+// It doesn't depend on Arduino beyond pgmspace, so it can be built and exercised on the host.
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#elif !defined(PROGMEM)
+#define PROGMEM
+#endif
+
+typedef unsigned char StateId;
+
+#define NO_STATE 0xFF
+
+// Special results of a state handler, any other value is the state to transition to.
+#define HANDLED 0xFE
+#define UNHANDLED 0xFD
+
+template <class EVENT>
+struct StateDef {
+  typedef void (*Action)();
+  typedef StateId (*Handler)(const EVENT &event);
+
+  StateId parent;   // NO_STATE for top level states
+  StateId initial;  // child entered when this state is the target of a transition, NO_STATE for leaves
+  Action entry;     // optional
+  Action exit;      // optional
+  Handler handle;   // optional, returns HANDLED, UNHANDLED (ask the parent) or a state to transition to
+};
+
+template <class EVENT>
+class Hsm {
+ public:
+  typedef StateDef<EVENT> Def;
+
+  Hsm(const Def *table) : table(table), current(NO_STATE) {}
+
+  StateId state() const { return current; }
+
+  // Enter the initial state, running entry actions from the top.
+  void start(StateId initial) {
+    current = NO_STATE;
+    transition(initial);
+  }
+
+  // Offer the event to the current state and then to its ancestors until someone handles it.
+  void dispatch(const EVENT &event) {
+    for (StateId s = current; s != NO_STATE; s = parentOf(s)) {
+      typename Def::Handler handle = handlerOf(s);
+      StateId result = handle ? handle(event) : UNHANDLED;
+      if (result == HANDLED) {
+        return;
+      }
+      if (result != UNHANDLED) {
+        transition(result);
+        return;
+      }
+    }
+  }
+
+  // Is the machine in the given state or any of its substates.
+  bool isIn(StateId state) const {
+    for (StateId s = current; s != NO_STATE; s = parentOf(s)) {
+      if (s == state) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Move to target: exit up to the common ancestor, enter down to target and follow initial substates.
+  // Targeting the current state or one of its ancestors exits and re-enters it.
+  void transition(StateId target) {
+    StateId common = commonAncestor(current, target);
+    for (StateId s = current; s != common; s = parentOf(s)) {
+      run(read(&table[s].exit));
+    }
+    enter(common, target);
+    current = target;
+    for (StateId s = initialOf(target); s != NO_STATE; s = initialOf(s)) {
+      run(read(&table[s].entry));
+      current = s;
+    }
+  }
+
+ private:
+  // Table fields live in flash on AVR and need an explicit read.
+  static StateId read(const StateId *field) {
+#if defined(__AVR__)
+    return pgm_read_byte(field);
+#else
+    return *field;
+#endif
+  }
+
+  template <class F>
+  static F read(const F *field) {
+#if defined(__AVR__)
+    return reinterpret_cast<F>(pgm_read_ptr(field));
+#else
+    return *field;
+#endif
+  }
+
+  StateId parentOf(StateId s) const { return s == NO_STATE ? NO_STATE : read(&table[s].parent); }
+  StateId initialOf(StateId s) const { return read(&table[s].initial); }
+  typename Def::Handler handlerOf(StateId s) const { return read(&table[s].handle); }
+
+  static void run(typename Def::Action action) {
+    if (action) {
+      action();
+    }
+  }
+
+  // Entry actions from just below `from` down to `to`, outermost first. Recursion depth is the nesting depth.
+  void enter(StateId from, StateId to) {
+    if (to == from || to == NO_STATE) {
+      return;
+    }
+    enter(from, parentOf(to));
+    run(read(&table[to].entry));
+  }
+
+  // Closest ancestor of target that is a strict ancestor of source too (or NO_STATE).
+  // Being strict means transitions to self or to an ancestor exit and re-enter the target.
+  StateId commonAncestor(StateId source, StateId target) const {
+    for (StateId t = parentOf(target); t != NO_STATE; t = parentOf(t)) {
+      for (StateId s = parentOf(source); s != NO_STATE; s = parentOf(s)) {
+        if (s == t) {
+          return t;
+        }
+      }
+      if (source != NO_STATE && t == source) {
+        return t;
+      }
+    }
+    return NO_STATE;
+  }
+
+  const Def *table;
+  StateId current;
+};
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef LEVEL_H
+#define LEVEL_H
+
+// Water volume from an analog pressure transducer at the bottom of the sump.
+// Sump and tub have different shapes, so the volume is not linear with the pressure: the board profile gives
+// LEVEL_CALIBRATION as {reading, millilitres} points, measured by filling known volumes into the empty machine.
+// Volumes between points are interpolated, readings outside the table are clamped to its ends.
+
+struct LevelPoint {
+  int reading;
+  unsigned int millilitres;
+};
+
+// Both readings and volumes must go up from one point to the next.
+template <unsigned char N>
+constexpr bool isValidCalibration(const LevelPoint (&points)[N], unsigned char i = 1) {
+  return i >= N || (points[i].reading > points[i - 1].reading && points[i].millilitres > points[i - 1].millilitres &&
+                    isValidCalibration(points, i + 1));
+}
+
+template <unsigned char N>
+unsigned int levelMillilitres(const LevelPoint (&points)[N], int reading) {
+  if (reading <= points[0].reading) {
+    return points[0].millilitres;
+  }
+  for (unsigned char i = 1; i < N; i++) {
+    if (reading < points[i].reading) {
+      const LevelPoint &low = points[i - 1];
+      const LevelPoint &high = points[i];
+      return low.millilitres + (unsigned long)(high.millilitres - low.millilitres) * (reading - low.reading) /
+                                   (high.reading - low.reading);
+    }
+  }
+  return points[N - 1].millilitres;
+}
+
+#endif
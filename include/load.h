@@ -0,0 +1,48 @@
+#ifndef LOAD_H
+#define LOAD_H
+
+#include "duration.h"
+
+// Guesses how full the machine is from the first fill and heat of a program.
+// Dishes hold some of the water the main pump sprays, so a full load takes longer to top up once the pump starts,
+// and they soak up heat, so a full load warms up slower than the water alone would.
+// Both are compared with what the machine does on its own: the top-up against the base level loadTime,
+// the heating rate against the rate of a machine full of water and no dishes.
+// The thresholds come from the board profile and only hold for the machine they were measured on.
+class LoadEstimate {
+ public:
+  // lightHeatingPercent: heating at least this fast, relative to emptyHeatingRate, is a light load.
+  // lightTopUpPercent: a top-up this short, relative to loadTime, is a light load.
+  LoadEstimate(float emptyHeatingRate, unsigned char lightHeatingPercent, unsigned char lightTopUpPercent)
+      : emptyHeatingRate(emptyHeatingRate),
+        lightHeatingPercent(lightHeatingPercent),
+        lightTopUpPercent(lightTopUpPercent),
+        heating(UNKNOWN),
+        topUp(UNKNOWN) {}
+
+  void reset() {
+    heating = UNKNOWN;
+    topUp = UNKNOWN;
+  }
+
+  void addTopUp(Milliseconds loadTime, Milliseconds topUpTime) {
+    topUp = topUpTime.count() * 100 <= loadTime.count() * lightTopUpPercent ? LIGHT : FULL;
+  }
+
+  // Centigrades per second, for the full water level.
+  void addHeating(float rate) { heating = rate * 100 >= emptyHeatingRate * lightHeatingPercent ? LIGHT : FULL; }
+
+  // Light only when both say so, washing a full load short is worse than wasting a bit on a light one.
+  bool isLight() const { return heating == LIGHT && topUp == LIGHT; }
+
+ private:
+  enum Vote { UNKNOWN, LIGHT, FULL };
+
+  float emptyHeatingRate;
+  unsigned char lightHeatingPercent;
+  unsigned char lightTopUpPercent;
+  Vote heating;
+  Vote topUp;
+};
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef MODBUS_H
+#define MODBUS_H
+
+// Modbus RTU framing, shared by the controller and host tools.
+// A frame is address, function, data and a CRC-16 (low byte first), frames are apart by 3.5 characters of silence.
+// Register values and addresses are big endian. No Arduino dependencies, it builds on the host as is.
+
+#define MODBUS_BROADCAST 0
+
+#define MODBUS_READ_HOLDING_REGISTERS 0x03
+#define MODBUS_READ_INPUT_REGISTERS 0x04
+#define MODBUS_WRITE_SINGLE_REGISTER 0x06
+#define MODBUS_WRITE_MULTIPLE_REGISTERS 0x10
+
+#define MODBUS_ILLEGAL_FUNCTION 0x01
+#define MODBUS_ILLEGAL_DATA_ADDRESS 0x02
+#define MODBUS_ILLEGAL_DATA_VALUE 0x03
+
+#define MODBUS_MAX_WRITE_BYTES 246 // 123 registers, the longest write fitting in a 256 byte frame
+
+// CRC-16 as used by Modbus: polynomial 0xA001 (reflected 0x8005), starting from 0xFFFF.
+// Running it over a whole frame, CRC included, gives 0.
+inline unsigned short crc16Update(unsigned short crc, unsigned char byte) {
+  crc ^= byte;
+  for (unsigned char b = 0; b < 8; b++) {
+    crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+  }
+  return crc;
+}
+
+inline unsigned short crc16(const unsigned char *data, unsigned char length) {
+  unsigned short crc = 0xFFFF;
+  for (unsigned char i = 0; i < length; i++) {
+    crc = crc16Update(crc, data[i]);
+  }
+  return crc;
+}
+
+// Append the CRC to the first length bytes of frame, returns the frame length.
+inline unsigned char sealFrame(unsigned char *frame, unsigned char length) {
+  unsigned short crc = crc16(frame, length);
+  frame[length] = crc & 0xFF;
+  frame[length + 1] = crc >> 8;
+  return length + 2;
+}
+
+inline bool isValidFrame(const unsigned char *frame, unsigned char length) {
+  if (length < 4) {
+    return false;
+  }
+  unsigned short crc = crc16(frame, length - 2);
+  return frame[length - 2] == (crc & 0xFF) && frame[length - 1] == (crc >> 8);
+}
+
+inline unsigned short readWord(const unsigned char *frame, unsigned char offset) {
+  return (unsigned short)(frame[offset] << 8 | frame[offset + 1]);
+}
+
+inline void writeWord(unsigned char *frame, unsigned char offset, unsigned short value) {
+  frame[offset] = value >> 8;
+  frame[offset + 1] = value & 0xFF;
+}
+
+// Turn the request in frame into an exception reply, returns its length.
+inline unsigned char modbusException(unsigned char *frame, unsigned char code) {
+  frame[1] |= 0x80;
+  frame[2] = code;
+  return sealFrame(frame, 3);
+}
+
+// Length of the register request starting in frame, once enough of it has been received to tell.
+// 0 while unknown, for functions other than the register ones and for writes longer than any valid one.
+inline unsigned char modbusRequestLength(const unsigned char *frame, unsigned char received) {
+  if (received < 2) {
+    return 0;
+  }
+  switch (frame[1]) {
+    case MODBUS_READ_HOLDING_REGISTERS:
+    case MODBUS_READ_INPUT_REGISTERS:
+    case MODBUS_WRITE_SINGLE_REGISTER:
+      return 8;
+    case MODBUS_WRITE_MULTIPLE_REGISTERS:
+      return received < 7 || frame[6] > MODBUS_MAX_WRITE_BYTES ? 0 : 9 + frame[6];
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef POWERBUS_H
+#define POWERBUS_H
+
+// Heater power tokens over RS-485, shared by the controller and the host coordinator (tools/power_coordinator.cpp).
+// Machines on one circuit can't all heat at once: a coordinator polls every controller in turn and hands out
+// heater power under a cap, a controller only switches its heater on while it holds a grant.
+//
+// Frames are Modbus RTU (see modbus.h) with a user defined function code, so they share the bus with the
+// register requests the controller answers too. The coordinator is then the bus master, register requests from
+// anyone else go through it (see --modbus).
+//
+//   poll    address POWER_FUNCTION grant                                  CRC   coordinator to controller
+//   status  address POWER_FUNCTION flags watts(2) remaining(2)           CRC   controller reply
+//
+// A grant lasts until the controller stops asking for power, or until its lease runs out: a controller gives its
+// grant back once POWER_LEASE_SECONDS pass without a poll carrying it, and with no poll at all for that long it has
+// no coordinator and heats on its own again. A poll without the grant never takes power back by itself.
+// The coordinator only renews grants of controllers that replied lately, and only hands out the power of a silent
+// holder once its lease has surely run out, so that power is never counted twice.
+// remaining is the expected heating time left in seconds, POWER_UNKNOWN_REMAINING before the heating rate is known.
+// No Arduino dependencies, it builds on the host as is.
+
+#include "modbus.h"
+
+#define POWER_FUNCTION 0x41 // first of the Modbus user defined function codes
+#define POWER_POLL_LENGTH 5
+#define POWER_STATUS_LENGTH 9
+#define POWER_MAX_ADDRESS 247
+#define POWER_LEASE_SECONDS 20
+
+#define POWER_WANTS 0x01 // heating, or waiting to
+#define POWER_HOLDS 0x02 // holds a grant
+#define POWER_UNKNOWN_REMAINING 0xFFFF
+
+struct PowerStatus {
+  unsigned char flags;
+  unsigned short watts;
+  unsigned short remaining;
+};
+
+inline unsigned char powerPoll(unsigned char *frame, unsigned char address, bool grant) {
+  frame[0] = address;
+  frame[1] = POWER_FUNCTION;
+  frame[2] = grant;
+  return sealFrame(frame, 3);
+}
+
+inline unsigned char powerStatus(unsigned char *frame, unsigned char address, const PowerStatus &status) {
+  frame[0] = address;
+  frame[1] = POWER_FUNCTION;
+  frame[2] = status.flags;
+  writeWord(frame, 3, status.watts);
+  writeWord(frame, 5, status.remaining);
+  return sealFrame(frame, 7);
+}
+
+inline bool isPowerPoll(const unsigned char *frame, unsigned char length) {
+  return length == POWER_POLL_LENGTH && frame[1] == POWER_FUNCTION && isValidFrame(frame, length);
+}
+
+inline bool isPowerStatus(const unsigned char *frame, unsigned char length) {
+  return length == POWER_STATUS_LENGTH && frame[1] == POWER_FUNCTION && isValidFrame(frame, length);
+}
+
+inline PowerStatus readPowerStatus(const unsigned char *frame) {
+  PowerStatus status;
+  status.flags = frame[2];
+  status.watts = readWord(frame, 3);
+  status.remaining = readWord(frame, 5);
+  return status;
+}
+
+#endif
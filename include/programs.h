@@ -0,0 +1,175 @@
+#ifndef PROGRAMS_H
+#define PROGRAMS_H
+
+#include <Arduino.h>
+#include "duration.h"
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#elif !defined(PROGMEM)
+#define PROGMEM
+#endif
+
+// Limits for program steps, checked at build time.
+#define MAX_WASH_MINUTES 60
+#define MAX_PROGRAM_MINUTES 120
+#define MIN_SENSOR_TEMPERATURE 500 // thermistor readings outside these are what the boot self-test sees as a broken sensor
+#define MAX_SENSOR_TEMPERATURE 1015
+#define MIN_TEMPERATURE 600  // thermistor reading, well clear of a broken sensor
+#define MAX_TEMPERATURE 1000 // thermistor reading, keep some room below the 1023 ADC ceiling
+#define MIN_FILL_PERCENT 60  // the main pump needs water well above the base level
+#define MAX_DRY_MINUTES 60
+#define MIN_RINSE_AID_MINUTES 2 // rinse aid goes in a while into the wash, see RINSE_AID_DELAY
+
+static_assert(MIN_SENSOR_TEMPERATURE < MIN_TEMPERATURE && MAX_TEMPERATURE < MAX_SENSOR_TEMPERATURE,
+              "Step temperatures must be readings a working sensor can give");
+
+// Dispensers to pulse in a step.
+#define DISPENSE_SOAP 0x01      // before heating
+#define DISPENSE_RINSE_AID 0x02 // during the wash
+
+// A single step of a program: load water, optionally release soap and heat, wash and drain.
+struct Step {
+  Minutes washTime;
+  unsigned char dispense; // DISPENSE_* flags
+  int temperature; // thermistor reading, 0 to skip heating
+  unsigned int dose; // thermal dose (A0) ending the wash once met, 0 for a fixed wash time, see thermal.h
+};
+
+// A program is a fixed list of steps. The steps are kept in flash on AVR, read them with readStep().
+// Programs themselves are a few bytes each and stay in RAM.
+struct Program {
+  const Step *steps;
+  unsigned char count;
+  unsigned char fill;   // water level, percent of the full level
+  const Program *light; // variant to carry on with when the first step finds a light load, nullptr for none
+  Minutes dryTime;      // longest passive drying after the final drain, 0 to finish right away
+};
+
+// Regular wash: pre-wash, soap wash, a cold rinse and a hot rinse leaving the dishes warm enough to dry on their own.
+// Temperature is defined by the reading of a thermistor, no fancy centigrades conversion here.
+// The soap wash ends on its thermal dose, 4 is what 12 minutes after reaching 910 (~60 C) deliver.
+constexpr Step REGULAR_STEPS[] PROGMEM = {
+  { Minutes(3), 0, 910, 0 },
+  { Minutes(12), DISPENSE_SOAP, 910, 4 },
+  { Minutes(3), 0, 0, 0 },
+  { Minutes(3), DISPENSE_RINSE_AID, 910, 0 },
+};
+
+// Regular wash for a light load: less water and shorter washes after the same pre-wash.
+constexpr Step LIGHT_STEPS[] PROGMEM = {
+  { Minutes(3), 0, 910, 0 },
+  { Minutes(8), DISPENSE_SOAP, 910, 3 },
+  { Minutes(2), 0, 0, 0 },
+  { Minutes(2), DISPENSE_RINSE_AID, 910, 0 },
+};
+
+// Drying on the residual heat of the final rinse, fewer dishes hold less water.
+constexpr Minutes REGULAR_DRY(30);
+constexpr Minutes LIGHT_DRY(20);
+
+// Rinse only.
+constexpr Step RINSE_STEPS[] PROGMEM = {
+  { Minutes(5), 0, 0, 0 },
+};
+
+// Wash time must be positive and small enough to be expressed in milliseconds within an unsigned long.
+constexpr bool isValidWashTime(Minutes washTime) {
+  return washTime.count() > 0 && washTime.count() <= MAX_WASH_MINUTES && washTime.fitsInMillis();
+}
+
+constexpr bool isValidTemperature(int temperature) {
+  return temperature == 0 || (temperature >= MIN_TEMPERATURE && temperature <= MAX_TEMPERATURE);
+}
+
+// Only heated steps can reach a dose, and a dose target may double the wash time.
+constexpr bool isValidDose(const Step &step) {
+  return step.dose == 0 || (step.temperature > 0 && step.washTime.count() * 2 <= MAX_WASH_MINUTES);
+}
+
+// Rinse aid needs a wash long enough to get to it.
+constexpr bool isValidDispense(const Step &step) {
+  return (step.dispense & ~(DISPENSE_SOAP | DISPENSE_RINSE_AID)) == 0 &&
+         (!(step.dispense & DISPENSE_RINSE_AID) || step.washTime.count() >= MIN_RINSE_AID_MINUTES);
+}
+
+constexpr bool isValidStep(const Step &step) {
+  return isValidWashTime(step.washTime) && isValidTemperature(step.temperature) && isValidDose(step) &&
+         isValidDispense(step);
+}
+
+template <size_t N>
+constexpr bool areValidSteps(const Step (&steps)[N], size_t i = 0) {
+  return i == N || (isValidStep(steps[i]) && areValidSteps(steps, i + 1));
+}
+
+// The last step must leave clean water behind, and cold unless the dishes cool down drying with the door closed.
+template <size_t N>
+constexpr bool endsSafely(const Step (&steps)[N], Minutes dryTime) {
+  return !(steps[N - 1].dispense & DISPENSE_SOAP) && (steps[N - 1].temperature == 0 || dryTime.count() > 0);
+}
+
+constexpr bool isValidDryTime(Minutes dryTime) {
+  return dryTime.count() <= MAX_DRY_MINUTES;
+}
+
+constexpr bool isValidFill(unsigned char fill) {
+  return fill >= MIN_FILL_PERCENT && fill <= 100;
+}
+
+// A light variant takes over from the next step on, so it must have the same steps and no variant of its own.
+constexpr bool isValidVariant(const Program &program) {
+  return program.light == nullptr || (program.light->count == program.count && program.light->light == nullptr);
+}
+
+// Total program length in minutes.
+template <size_t N>
+constexpr unsigned long totalMinutes(const Step (&steps)[N], size_t i = 0) {
+  return i == N ? 0 : steps[i].washTime.count() + totalMinutes(steps, i + 1);
+}
+
+// Step of a program, steps live in flash on AVR and need an explicit read.
+inline Step readStep(const Program &program, unsigned char index) {
+#if defined(__AVR__)
+  Step step;
+  memcpy_P(&step, &program.steps[index], sizeof(Step));
+  return step;
+#else
+  return program.steps[index];
+#endif
+}
+
+static_assert(areValidSteps(REGULAR_STEPS), "Regular program has an invalid step");
+static_assert(endsSafely(REGULAR_STEPS, REGULAR_DRY), "Regular program must end with a cold rinse without soap, or dry");
+static_assert(totalMinutes(REGULAR_STEPS) + REGULAR_DRY.count() <= MAX_PROGRAM_MINUTES, "Regular program is too long");
+static_assert(areValidSteps(LIGHT_STEPS), "Light program has an invalid step");
+static_assert(endsSafely(LIGHT_STEPS, LIGHT_DRY), "Light program must end with a cold rinse without soap, or dry");
+static_assert(totalMinutes(LIGHT_STEPS) + LIGHT_DRY.count() <= MAX_PROGRAM_MINUTES, "Light program is too long");
+static_assert(areValidSteps(RINSE_STEPS), "Rinse program has an invalid step");
+static_assert(endsSafely(RINSE_STEPS, Minutes(0)), "Rinse program must end with a cold rinse without soap");
+static_assert(totalMinutes(RINSE_STEPS) <= MAX_PROGRAM_MINUTES, "Rinse program is too long");
+
+constexpr Program LIGHT_PROGRAM = { LIGHT_STEPS, sizeof(LIGHT_STEPS) / sizeof(Step), 75, nullptr, LIGHT_DRY };
+constexpr Program REGULAR_PROGRAM = { REGULAR_STEPS, sizeof(REGULAR_STEPS) / sizeof(Step), 100, &LIGHT_PROGRAM, REGULAR_DRY };
+constexpr Program RINSE_PROGRAM = { RINSE_STEPS, sizeof(RINSE_STEPS) / sizeof(Step), 100, nullptr, Minutes(0) };
+// Picked by hand for a half load, the light steps from the start with even less water.
+constexpr Program HALF_PROGRAM = { LIGHT_STEPS, sizeof(LIGHT_STEPS) / sizeof(Step), 60, nullptr, LIGHT_DRY };
+
+// The same rules as above, for programs put together from steps and drying times of others.
+constexpr unsigned long programMinutes(const Program &program, unsigned char i = 0) {
+  return i == program.count ? 0 : program.steps[i].washTime.count() + programMinutes(program, i + 1);
+}
+
+constexpr bool isValidProgram(const Program &program) {
+  return program.count > 0 && isValidFill(program.fill) && isValidDryTime(program.dryTime) &&
+         programMinutes(program) + program.dryTime.count() <= MAX_PROGRAM_MINUTES &&
+         !(program.steps[program.count - 1].dispense & DISPENSE_SOAP) &&
+         (program.steps[program.count - 1].temperature == 0 || program.dryTime.count() > 0);
+}
+
+static_assert(isValidProgram(REGULAR_PROGRAM) && isValidProgram(LIGHT_PROGRAM) && isValidProgram(RINSE_PROGRAM) &&
+                  isValidProgram(HALF_PROGRAM),
+              "Program fill level, drying or length out of range");
+static_assert(isValidVariant(REGULAR_PROGRAM) && isValidVariant(RINSE_PROGRAM), "Light variant doesn't match its program");
+
+#endif
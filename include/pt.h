@@ -0,0 +1,66 @@
+#ifndef PT_H
+#define PT_H
+
+// Stackless coroutines (protothreads).
+// A thread is a function taking a Pt, it keeps its sequential structure but yields instead of blocking:
+// every call resumes right after the last wait. Each thread costs 2 bytes of RAM, there is no stack per thread.
+// Mind that local variables do not survive a wait, keep state in globals or in the caller.
+// Waits are built on a switch, so a thread can't use switch statements around them.
+
+#include "timer.h"
+
+struct Pt {
+  unsigned short lc;
+};
+
+// Waits fall through from the resume point assignment into its case label on purpose.
+#if defined(__GNUC__) && __GNUC__ >= 7
+#define PT_FALLTHROUGH __attribute__((fallthrough))
+#else
+#define PT_FALLTHROUGH
+#endif
+
+#define PT_WAITING 0
+#define PT_ENDED 1
+
+#define PT_THREAD(declaration) char declaration
+
+#define PT_INIT(pt) ((pt)->lc = 0)
+
+#define PT_BEGIN(pt) \
+  switch ((pt)->lc) { \
+    case 0:
+
+#define PT_END(pt) \
+  } \
+  (pt)->lc = 0; \
+  return PT_ENDED
+
+// Return now and resume here on the next call once the condition is true.
+#define PT_WAIT_UNTIL(pt, condition) \
+  do { \
+    (pt)->lc = __LINE__; \
+    PT_FALLTHROUGH; \
+    case __LINE__: \
+      if (!(condition)) { \
+        return PT_WAITING; \
+      } \
+  } while (0)
+
+#define PT_WAIT_WHILE(pt, condition) PT_WAIT_UNTIL(pt, !(condition))
+
+// Run a child thread until it ends.
+#define PT_SPAWN(pt, child, thread) \
+  do { \
+    PT_INIT(child); \
+    PT_WAIT_UNTIL(pt, (thread) == PT_ENDED); \
+  } while (0)
+
+// Non-blocking delay() replacement, timer is a Timer dedicated to this thread.
+#define PT_DELAY(pt, timer, duration) \
+  do { \
+    (timer).restart(); \
+    PT_WAIT_UNTIL(pt, (timer).hasElapsed(duration)); \
+  } while (0)
+
+#endif
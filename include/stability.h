@@ -0,0 +1,101 @@
+#ifndef STABILITY_H
+#define STABILITY_H
+
+#include "duration.h"
+#include "timer.h"
+
+// Decides when a noisy sensor reading can be trusted.
+// The detector is stable once a full window has been observed with at least requiredPercent of that time good.
+// Time between two updates is credited to the newest reading. As soon as the bad time exceeds what the
+// window tolerates, the window starts over, so a required 100% behaves like a strict reset on any bad reading.
+class StabilityDetector {
+ public:
+  template <unsigned long U>
+  explicit StabilityDetector(Duration<U> window, unsigned char requiredPercent = 100)
+      : window(window.toMillis()),
+        tolerance(percentOf(window.toMillis(), 100 - (requiredPercent > 100 ? 100 : requiredPercent))),
+        good(0),
+        bad(0) {}
+
+  // Feed the latest reading.
+  void update(bool ok) {
+    unsigned long dt = lastUpdate.elapsed().count();
+    lastUpdate.restart();
+
+    if (ok) {
+      good += dt;
+    } else {
+      bad += dt;
+      if (bad >= tolerance) {
+        restart();
+      }
+    }
+  }
+
+  bool isStable() const { return good + bad >= window; }
+
+  void restart() {
+    good = 0;
+    bad = 0;
+    lastUpdate.restart();
+  }
+
+ private:
+  // percent% of ms, without overflowing for large windows.
+  static unsigned long percentOf(unsigned long ms, unsigned char percent) {
+    return ms / 100 * percent + ms % 100 * percent / 100;
+  }
+
+  unsigned long window;
+  unsigned long tolerance;
+  unsigned long good;
+  unsigned long bad;
+  Timer lastUpdate;
+};
+
+// Turns an analog reading into a digital one with hysteresis, so a value hovering around
+// the threshold doesn't toggle on every sample.
+// Goes on at or above threshold + hysteresis, off at or below threshold - hysteresis.
+class AnalogThreshold {
+ public:
+  AnalogThreshold(int threshold, int hysteresis) : threshold(threshold), hysteresis(hysteresis), state(false) {}
+
+  bool update(int value) {
+    if (value >= threshold + hysteresis) {
+      state = true;
+    } else if (value <= threshold - hysteresis) {
+      state = false;
+    }
+    return state;
+  }
+
+  bool isOn() const { return state; }
+
+ private:
+  int threshold;
+  int hysteresis;
+  bool state;
+};
+
+// Stability of an analog sensor being above a threshold.
+class AnalogStabilityDetector {
+ public:
+  template <unsigned long U>
+  AnalogStabilityDetector(int threshold, int hysteresis, Duration<U> window, unsigned char requiredPercent = 100)
+      : level(threshold, hysteresis), detector(window, requiredPercent) {}
+
+  void update(int value) { detector.update(level.update(value)); }
+
+  bool isStable() const { return detector.isStable(); }
+
+  // Latest reading above the threshold, with hysteresis.
+  bool isOn() const { return level.isOn(); }
+
+  void restart() { detector.restart(); }
+
+ private:
+  AnalogThreshold level;
+  StabilityDetector detector;
+};
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+// What the controller reports about itself, over Modbus and in its telemetry ("state" and "outputs" lines),
+// shared with the host tools making sense of it. No Arduino dependencies, it builds on the host as is.
+
+// Program state machine
+//
+//  IDLE
+//  SELECT              switch pressed, a long press picks the rinse program, a double press the half load one
+//  PROGRAM             safety super-state, everything is switched off when leaving it, held while the door is open
+//    CYCLE             one step of the program
+//      FILL            water loading
+//        FILL_BASE     until base level, loadTime is the time it took
+//        FILL_DOUBLE   one more loadTime (double level), skipped with a level sensor
+//        FILL_TOP_UP   main pump on, until the level is stable again
+//      HEAT            soap and heat until the step temperature
+//      WASH            step wash time, rinse aid on the way
+//      DRAIN
+//        DRAIN_LEVEL   until low level is reached
+//        DRAIN_EXTRA   some fixed extra time
+//    DRY               passive drying on the residual heat, venting now and then
+//  DONE
+//  LEAK                emergency drain, then FAULT
+//  FAULT
+enum State {
+  STATE_IDLE,
+  STATE_SELECT,
+  STATE_PROGRAM,
+  STATE_CYCLE,
+  STATE_FILL,
+  STATE_FILL_BASE,
+  STATE_FILL_DOUBLE,
+  STATE_FILL_TOP_UP,
+  STATE_HEAT,
+  STATE_WASH,
+  STATE_DRAIN,
+  STATE_DRAIN_LEVEL,
+  STATE_DRAIN_EXTRA,
+  STATE_DRY,
+  STATE_DONE,
+  STATE_LEAK,
+  STATE_FAULT,
+  STATE_COUNT
+};
+
+// Names for host tools, in State order. Only the host tools use these, they take no room in the controller.
+constexpr const char *STATE_NAMES[] = {
+  "idle", "select", "program", "cycle", "fill", "fill_base", "fill_double", "fill_top_up", "heat", "wash",
+  "drain", "drain_level", "drain_extra", "dry", "done", "leak", "fault",
+};
+
+// Program phase each state belongs to, nullptr outside a program phase.
+constexpr const char *STATE_PHASES[] = {
+  nullptr, nullptr, nullptr, nullptr, "fill", "fill", "fill", "fill", "heat", "wash",
+  "drain", "drain", "drain", "dry", nullptr, "drain", nullptr,
+};
+
+static_assert(sizeof(STATE_NAMES) / sizeof(STATE_NAMES[0]) == STATE_COUNT, "STATE_NAMES must name every State");
+static_assert(sizeof(STATE_PHASES) / sizeof(STATE_PHASES[0]) == STATE_COUNT, "STATE_PHASES must cover every State");
+
+// Bits of the outputs value, lowest first.
+constexpr const char *OUTPUT_NAMES[] = { "water-load", "main-pump", "drain", "heater", "soap", "rinse-aid", "vent" };
+#define OUTPUT_COUNT (sizeof(OUTPUT_NAMES) / sizeof(OUTPUT_NAMES[0]))
+#define HEATER_OUTPUT 3
+
+#endif
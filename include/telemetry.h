@@ -0,0 +1,89 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <Arduino.h>
+
+// Telemetry lines for host tools, one reading per line:
+//
+//   T <millis> <name> <value>
+//
+// Host tools send commands back the same way, one per line:
+//
+//   C <name> [<argument>]
+//
+// Only boards whose profile defines TELEMETRY_SERIAL report, everywhere else these compile to nothing.
+#if defined(TELEMETRY_SERIAL)
+
+#ifndef TELEMETRY_BAUD
+#define TELEMETRY_BAUD 115200
+#endif
+
+inline void telemetryBegin() {
+  TELEMETRY_SERIAL.begin(TELEMETRY_BAUD);
+}
+
+inline void telemetryHeader(const char *name) {
+  TELEMETRY_SERIAL.print(F("T "));
+  TELEMETRY_SERIAL.print(millis());
+  TELEMETRY_SERIAL.print(' ');
+  TELEMETRY_SERIAL.print(name);
+  TELEMETRY_SERIAL.print(' ');
+}
+
+inline void telemetry(const char *name, long value) {
+  telemetryHeader(name);
+  TELEMETRY_SERIAL.println(value);
+}
+
+inline void telemetry(const char *name, int value) {
+  telemetry(name, (long)value);
+}
+
+inline void telemetry(const char *name, float value) {
+  telemetryHeader(name);
+  TELEMETRY_SERIAL.println(value, 1);
+}
+
+inline void telemetry(const char *name, const char *value) {
+  telemetryHeader(name);
+  TELEMETRY_SERIAL.println(value);
+}
+
+#define TELEMETRY_COMMAND_LENGTH 24
+
+// Collect what has arrived so far, returns the command after the "C " once its line is complete, nullptr until then.
+// Lines too long for the buffer and lines that aren't commands are dropped.
+inline const char *telemetryCommand() {
+  static char line[TELEMETRY_COMMAND_LENGTH];
+  static unsigned char length = 0;
+  while (TELEMETRY_SERIAL.available()) {
+    char c = TELEMETRY_SERIAL.read();
+    if (c == '\n' || c == '\r') {
+      bool isCommand = length > 2 && length < sizeof(line) && line[0] == 'C' && line[1] == ' ';
+      line[isCommand ? length : 0] = 0;
+      length = 0;
+      if (isCommand) {
+        return line + 2;
+      }
+    } else if (length < 0xFF) {
+      if (length < sizeof(line)) {
+        line[length] = c;
+      }
+      length++;
+    }
+  }
+  return nullptr;
+}
+
+#else
+
+inline void telemetryBegin() {}
+inline void telemetry(const char *, long) {}
+inline void telemetry(const char *, int) {}
+inline void telemetry(const char *, float) {}
+inline void telemetry(const char *, const char *) {}
+inline const char *telemetryCommand() { return nullptr; }
+
+#endif
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef THERMAL_H
+#define THERMAL_H
+
+#include <math.h>
+#include "duration.h"
+
+// Thermistor divider: NTC on the high side, fixed resistor to ground, so readings go up with temperature.
+// Boards with different parts override these in their profile.
+#ifndef THERMISTOR_R25
+#define THERMISTOR_R25 5000.0   // ohms at 25 C
+#endif
+#ifndef THERMISTOR_BETA
+#define THERMISTOR_BETA 3950.0
+#endif
+#ifndef THERMISTOR_DIVIDER_R
+#define THERMISTOR_DIVIDER_R 10000.0
+#endif
+
+// Thermistor reading to centigrades, beta equation.
+inline float thermistorCelsius(int reading) {
+  if (reading <= 0 || reading >= 1023) {
+    return reading <= 0 ? -273.15f : 200.0f;
+  }
+  float ntc = THERMISTOR_DIVIDER_R * (1023.0f / reading - 1);
+  return 1.0f / (1.0f / 298.15f + logf(ntc / THERMISTOR_R25) / THERMISTOR_BETA) - 273.15f;
+}
+
+// Thermal dose as A0: equivalent seconds at 80 C, every 10 C (z value) multiplies lethality by 10.
+// Water below DOSE_MIN_CELSIUS doesn't count at all.
+#define DOSE_REFERENCE_CELSIUS 80.0f
+#define DOSE_Z_CELSIUS 10.0f
+#define DOSE_MIN_CELSIUS 50.0f
+
+class ThermalDose {
+ public:
+  ThermalDose() : a0(0) {}
+
+  void reset() { a0 = 0; }
+
+  // Credit dt spent at the given temperature.
+  void add(float celsius, Milliseconds dt) {
+    if (celsius >= DOSE_MIN_CELSIUS) {
+      a0 += powf(10.0f, (celsius - DOSE_REFERENCE_CELSIUS) / DOSE_Z_CELSIUS) * dt.count() / 1000.0f;
+    }
+  }
+
+  float value() const { return a0; }
+
+ private:
+  float a0;
+};
+
+#endif
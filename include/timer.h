@@ -0,0 +1,79 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "duration.h"
+
+// Non-blocking timing primitives for millis() loops.
+// Every check is a single subtraction and comparison, so they can be polled on each tick.
+
+// Restartable timer, measures the time since the last (re)start.
+// It can be paused, elapsed() holds still until resume() and a restart() also unpauses it.
+class Timer {
+ public:
+  Timer() : started(Timestamp::now()), paused(false) {}
+
+  void restart() {
+    started = Timestamp::now();
+    paused = false;
+  }
+
+  // While paused, started holds the elapsed time rather than a point in time.
+  void pause() {
+    if (!paused) {
+      started = Timestamp(elapsed().count());
+      paused = true;
+    }
+  }
+
+  void resume() {
+    if (paused) {
+      started = Timestamp::now() - elapsed();
+      paused = false;
+    }
+  }
+
+  Milliseconds elapsed() const { return paused ? started.elapsedSince(Timestamp()) : started.elapsed(); }
+
+  template <unsigned long U>
+  bool hasElapsed(Duration<U> d) const { return elapsed() >= d; }
+
+ private:
+  Timestamp started;
+  bool paused;
+};
+
+// One-shot deadline, expires once the given duration has passed since it was armed.
+// Once expired it stays expired until armed again, even if millis() rolls over.
+template <unsigned long U>
+class Deadline {
+ public:
+  explicit Deadline(Duration<U> length) : length(length), expiredFlag(false) {}
+
+  void arm() {
+    timer.restart();
+    expiredFlag = false;
+  }
+
+  // Arm with a new length.
+  void arm(Duration<U> newLength) {
+    length = newLength;
+    arm();
+  }
+
+  void pause() { timer.pause(); }
+  void resume() { timer.resume(); }
+
+  bool expired() {
+    if (!expiredFlag && timer.hasElapsed(length)) {
+      expiredFlag = true;
+    }
+    return expiredFlag;
+  }
+
+ private:
+  Timer timer;
+  Duration<U> length;
+  bool expiredFlag;
+};
+
+#endif
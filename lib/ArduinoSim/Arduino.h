@@ -0,0 +1,98 @@
+#ifndef ARDUINO_SIM_ARDUINO_H
+#define ARDUINO_SIM_ARDUINO_H
+
+// Just enough of the Arduino API to build the controller on the host, backed by the plant model in sim.cpp.
+
+#define ARDUINO_SIM
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HIGH 1
+#define LOW 0
+
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define CHANGE 1
+#define FALLING 2
+
+#define A0 14
+#define A1 15
+#define A2 16
+#define A3 17
+#define A4 18
+#define A5 19
+#define A6 20
+#define A7 21
+
+#define bit(b) (1UL << (b))
+#define F(string) (string)
+
+typedef uint8_t byte;
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t level);
+int digitalRead(uint8_t pin);
+int analogRead(uint8_t pin);
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+void tone(uint8_t pin, unsigned int frequency, unsigned long duration = 0);
+
+inline int digitalPinToInterrupt(uint8_t pin) { return pin; }
+void attachInterrupt(int interrupt, void (*handler)(), int mode);
+
+// There are no real interrupts, handlers run from the simulation step between two instructions of the controller.
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+// Serial port, written to stdout, or to the terminal device given with --telemetry which can also send to it.
+class SimSerial {
+ public:
+  void begin(unsigned long baud);
+  int available();
+  int read();
+  void print(const char *text);
+  void print(char c);
+  void print(long value);
+  void print(unsigned long value);
+  void print(int value) { print((long)value); }
+  void print(double value, int digits = 2);
+  template <class T>
+  void println(T value) {
+    print(value);
+    print('\n');
+  }
+  void println(double value, int digits) {
+    print(value, digits);
+    print('\n');
+  }
+};
+
+extern SimSerial Serial;
+
+// Serial port backed by a host terminal device (--bus), a pseudo terminal stands for an RS-485 bus.
+// Without a device nothing is ever received and writes go nowhere.
+class SimPort {
+ public:
+  void begin(unsigned long baud);
+  int available();
+  int read();
+  size_t write(const uint8_t *data, size_t length);
+  void flush() {}
+};
+
+extern SimPort Serial1;
+
+// Bus address given with --address.
+uint8_t simBusAddress();
+
+// Let simulated time pass until the next interrupt, 1 millisecond at most.
+void simIdle();
+
+#endif
@@ -0,0 +1,581 @@
+// Host simulator: runs the controller against a simple model of the machine, in simulated time.
+//
+//   dishwasher [--rinse | --half] [--press SECONDS] [--inlet CELSIUS] [--dishes KG] [--dead RELAY | level]
+//              [--stuck RELAY] [--leak SECONDS] [--door SECONDS [--door-for SECONDS]]
+//              [--bus DEVICE --address N [--speed FACTOR]] [--telemetry DEVICE] [--clock MILLIS] [--minutes MINUTES]
+//              [--verbose]
+//
+// Prints every relay change and a summary once the program is done, or the time limit is reached.
+// --dead level leaves the pressure transducer reading an empty tub, like a split hose, the fill must catch it.
+// With --leak it prints how long the controller took to react to the leak instead, and fails if that took too long.
+// With --door the door is opened for a while, pump and heater must stop right away and stay off until it closes.
+// Opened during the top-up of a fill, the level must be watched again with the main pump back before moving on.
+// With --bus the power bus goes to a terminal device, like the pseudo terminals of tools/power_coordinator --pty.
+// With --telemetry the telemetry lines go to a terminal device instead of stdout, and commands come back from it,
+// like the pseudo terminals of tools/mqtt_gateway --pty. A negative --press never presses the switch.
+// millis() wraps at 32 bits as on the boards, --clock starts it somewhere else than 0: --clock 4294900000 rolls it
+// over about a minute into the program.
+// Simulated time runs as fast as it can, --speed ties it to the wall clock (times faster) so several simulated
+// controllers and the coordinator share the same timeline.
+
+// Left out of the host tests, they bring their own main() and clock.
+#ifndef PIO_UNIT_TESTING
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include "Arduino.h"
+#include "board.h"
+
+void setup();
+void loop();
+
+namespace {
+
+// Machine model.
+const double FILL_RATE = 0.1;       // liters per second with the inlet valve open
+const double DRAIN_RATE = 0.3;      // liters per second with the drain pump on
+const double LEVEL_SWITCH = 1.5;    // liters at the level switch (base level)
+const double PIPES_VOLUME = 0.6;    // liters the main pump keeps up in the pipes
+const double HEATER_POWER = 2000;   // watts
+const double HEAT_LOSS = 4;         // watts per degree above ambient
+const double AMBIENT = 20;          // celsius
+const double WATER_HEAT = 4186;     // joules per liter and degree
+const double HEATER_AMPS = 8.7;     // RMS current of the loads, 230V mains at 50 Hz
+const double MAIN_PUMP_AMPS = 0.8;
+const double DRAIN_AMPS = 0.35;
+const double MAINS_HZ = 50;
+const double DISH_HEAT = 600;       // joules per kilogram of dishes and degree, a mix of ceramic, glass and plastic
+const double DISH_RETAINED = 0.05;  // liters per kilogram of dishes held while the main pump sprays
+const double SUMP_VOLUME = 1;       // liters in the sump, below the tub
+const double SUMP_AREA = 50;        // cm2
+const double TUB_AREA = 400;        // cm2
+const unsigned long LEAK_RESPONSE_LIMIT = 50; // ms to cut the inlet and heater and to start draining
+const unsigned long DOOR_RESPONSE_LIMIT = 50; // ms to stop the inlet, main pump and heater, one control tick
+const unsigned long DOOR_TOP_UP_MINIMUM = 5000; // ms from the main pump coming back to heater, soap or drain:
+                                                // the shortest level window (2 s) and the 3 s before heating
+
+// Thermistor divider: 5k NTC (beta 3950) on the high side, 10k to ground.
+const double NTC_R25 = 5000;
+const double NTC_BETA = 3950;
+const double DIVIDER_R = 10000;
+
+struct Options {
+  bool rinse = false;
+  bool half = false; // double press
+  double pressAt = 5;
+  double inlet = 15;
+  double dishes = 4; // a full load
+  double minutes = 180;
+  bool verbose = false;
+  const char *dead = "";  // relay name, or level for the transducer
+  const char *stuck = "";
+  double leakAt = -1; // seconds, water in the base pan from then on
+  double doorAt = -1; // seconds, the door is opened then
+  double doorFor = 60;
+  const char *bus = nullptr; // terminal device
+  const char *telemetry = nullptr; // terminal device
+  uint8_t address = 1;
+  double speed = 0; // times the wall clock, 0 for as fast as possible
+  uint32_t clock = 0; // millis() at power on
+};
+
+struct Relay {
+  const char *name;
+  uint8_t pin;
+  uint8_t active;
+  bool on;        // real state
+  bool dead;      // draws no current and does nothing
+  bool stuck;     // welded contact, stays on once switched on
+};
+
+Options options;
+unsigned long now = 0;
+uint8_t levels[64];
+double volume = 0;
+double temperature = AMBIENT;
+double waterUsed = 0;
+double energyUsed = 0; // joules
+unsigned long beeps = 0;
+unsigned long ledOnSince = 0;
+long leakCut = -1; // ms from the leak until inlet and heater were off
+long leakDrain = -1; // ms from the leak until the drain pump started
+long doorStop = -1; // ms from opening the door until inlet, main pump and heater were off
+bool doorOpened = false;
+bool doorTopUp = false;   // the door opened during a top-up, checked until the program moves on
+long pumpBack = -1;       // ms when the main pump came back after the door closed
+int busFd = -1;
+int telemetryFd = -1;
+FILE *telemetryOut = stdout;
+double wallStart = 0;
+
+Relay relays[] = {
+  { "water-load", WaterLoadRelay::pin, WaterLoadRelay::active, false, false, false },
+  { "main-pump", MainPumpRelay::pin, MainPumpRelay::active, false, false, false },
+  { "drain", DrainRelay::pin, DrainRelay::active, false, false, false },
+  { "soap", SoapRelay::pin, SoapRelay::active, false, false, false },
+#ifdef HAS_RINSE_AID_RELAY
+  { "rinse-aid", RinseAidRelay::pin, RinseAidRelay::active, false, false, false },
+#endif
+  { "heater", HeaterRelay::pin, HeaterRelay::active, false, false, false },
+  { "led", StatusLed::pin, StatusLed::active, false, false, false },
+#ifdef HAS_VENT_RELAY
+  { "vent", VentRelay::pin, VentRelay::active, false, false, false },
+#endif
+};
+
+struct Interrupt {
+  void (*handler)();
+  int level;
+};
+
+Interrupt attached[64];
+
+// Real state of the load, a dead one never runs.
+bool isOn(uint8_t pin) {
+  for (Relay &relay : relays) {
+    if (relay.pin == pin) {
+      return relay.on && !relay.dead;
+    }
+  }
+  return false;
+}
+
+// Hall effect current sensor centred at half of the 5V supply, sampled at any point of the mains sine.
+int currentReading(double amps, unsigned int mvPerAmp) {
+  double millivolts = amps * sqrt(2.0) * sin(2 * M_PI * MAINS_HZ * now / 1000) * mvPerAmp;
+  return (int)(511.5 + millivolts * 1023 / 5000 + 0.5);
+}
+
+// Volume seen by the level switch, the main pump keeps some water up in the pipes and on the dishes.
+double sensedVolume() {
+  return volume - (isOn(MainPumpRelay::pin) ? PIPES_VOLUME + options.dishes * DISH_RETAINED : 0);
+}
+
+// Water and dishes share the same temperature, joules per degree.
+double heatCapacity() {
+  return volume * WATER_HEAT + options.dishes * DISH_HEAT;
+}
+
+int thermistorReading() {
+  double ntc = NTC_R25 * exp(NTC_BETA * (1 / (temperature + 273.15) - 1 / 298.15));
+  return (int)(1023 * DIVIDER_R / (DIVIDER_R + ntc));
+}
+
+#ifdef LEVEL_SENSOR_PIN
+// Pressure transducer at the bottom of the sump: 5V MPX5010 like, 0.2V offset and 0.45V per kPa.
+int levelReading() {
+  double liters = strcmp(options.dead, "level") ? sensedVolume() : 0;
+  double cm = liters < SUMP_VOLUME ? liters * 1000 / SUMP_AREA
+                                   : SUMP_VOLUME * 1000 / SUMP_AREA + (liters - SUMP_VOLUME) * 1000 / TUB_AREA;
+  double kpa = cm * 0.0981;
+  return (int)(1023 * (0.04 + 0.09 * kpa) + 0.5);
+}
+#endif
+
+double wallSeconds() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Hold simulated time back to options.speed times the wall clock.
+void pace() {
+  double ahead = now / 1000.0 / options.speed - (wallSeconds() - wallStart);
+  if (ahead > 0.001) {
+    usleep((useconds_t)(ahead * 1e6));
+  }
+}
+
+int openTerminal(const char *device) {
+  int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    perror(device);
+    exit(2);
+  }
+  termios tio;
+  if (tcgetattr(fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+  }
+  return fd;
+}
+
+// Bytes waiting on a terminal device, 0 without one.
+int pending(int fd) {
+  int count = 0;
+  return fd >= 0 && ioctl(fd, FIONREAD, &count) == 0 ? count : 0;
+}
+
+int readByte(int fd) {
+  uint8_t c;
+  return fd >= 0 && ::read(fd, &c, 1) == 1 ? c : -1;
+}
+
+void summary(const char *reason) {
+  printf("%9.3f %s: water %.1f l, heater %.3f kWh, %lu beeps\n", now / 1000.0, reason, waterUsed,
+         energyUsed / 3600000, beeps);
+}
+
+bool isLeaking() {
+  return options.leakAt >= 0 && now >= options.leakAt * 1000;
+}
+
+bool isDoorOpen() {
+  return options.doorAt >= 0 && now >= options.doorAt * 1000 && now < (options.doorAt + options.doorFor) * 1000;
+}
+
+// Inlet, main pump and heater must stop within DOOR_RESPONSE_LIMIT of opening the door and stay off until it closes.
+void checkDoorResponse() {
+  long since = now - (long)(options.doorAt * 1000);
+  bool running = isOn(MainPumpRelay::pin) || isOn(HeaterRelay::pin) || isOn(WaterLoadRelay::pin);
+  if (doorStop < 0) {
+    if (!running) {
+      doorStop = since;
+      printf("%9.3f door response: stop %ld ms\n", now / 1000.0, doorStop);
+    } else if (since > (long)DOOR_RESPONSE_LIMIT) {
+      summary("door not handled");
+      exit(3);
+    }
+    return;
+  }
+  if (running) {
+    summary("running with the door open");
+    exit(3);
+  }
+}
+
+// Levels read with the door open were taken with the pipes empty, a top-up held by the door must watch the level
+// again with the main pump back before the program moves on.
+void checkTopUpAfterDoor() {
+  if (pumpBack < 0) {
+    pumpBack = isOn(MainPumpRelay::pin) ? now : -1;
+    return;
+  }
+  if (!isOn(HeaterRelay::pin) && !isOn(SoapRelay::pin) && !isOn(DrainRelay::pin)) {
+    return;
+  }
+  doorTopUp = false;
+  long settled = now - pumpBack;
+  printf("%9.3f door top-up: moved on %ld ms after the main pump came back\n", now / 1000.0, settled);
+  if (settled < (long)DOOR_TOP_UP_MINIMUM) {
+    summary("top-up ended on the level read with the door open");
+    exit(3);
+  }
+}
+
+// Once leaking, the inlet and heater must go off and the drain pump on within LEAK_RESPONSE_LIMIT.
+void checkLeakResponse() {
+  long since = now - (long)(options.leakAt * 1000);
+  if (leakCut < 0 && !isOn(WaterLoadRelay::pin) && !isOn(HeaterRelay::pin)) {
+    leakCut = since;
+  }
+  if (leakDrain < 0 && isOn(DrainRelay::pin)) {
+    leakDrain = since;
+  }
+  if (leakCut < 0 || leakDrain < 0) {
+    if (since > (long)LEAK_RESPONSE_LIMIT) {
+      summary("leak not handled");
+      exit(3);
+    }
+    return;
+  }
+  if (since == (leakCut > leakDrain ? leakCut : leakDrain)) {
+    printf("%9.3f leak response: cut %ld ms, drain %ld ms\n", now / 1000.0, leakCut, leakDrain);
+  }
+  if (sensedVolume() < LEVEL_SWITCH && !isOn(DrainRelay::pin)) {
+    summary("leak drained");
+    exit(0);
+  }
+}
+
+// Advance the model by one millisecond and run the interrupts of inputs that changed.
+void step() {
+  now++;
+  const double dt = 0.001;
+
+  if (isOn(WaterLoadRelay::pin)) {
+    double added = FILL_RATE * dt;
+    double capacity = heatCapacity();
+    temperature = (temperature * capacity + options.inlet * added * WATER_HEAT) / (capacity + added * WATER_HEAT);
+    volume += added;
+    waterUsed += added;
+  }
+  if (isOn(DrainRelay::pin)) {
+    volume = volume > DRAIN_RATE * dt ? volume - DRAIN_RATE * dt : 0;
+  }
+  if (isOn(HeaterRelay::pin)) {
+    energyUsed += HEATER_POWER * dt;
+    if (volume > 0.1) {
+      temperature += HEATER_POWER * dt / heatCapacity();
+    }
+  }
+  if (volume > 0.1) {
+    temperature -= HEAT_LOSS * (temperature - AMBIENT) * dt / heatCapacity();
+  }
+
+  if (options.speed > 0 && now % 10 == 0) {
+    pace();
+  }
+  if (isLeaking()) {
+    checkLeakResponse();
+  }
+  if (isDoorOpen()) {
+    if (!doorOpened) {
+      doorOpened = true;
+      doorTopUp = isOn(WaterLoadRelay::pin) && isOn(MainPumpRelay::pin);
+    }
+    checkDoorResponse();
+  } else if (doorTopUp) {
+    checkTopUpAfterDoor();
+  }
+  if (isOn(StatusLed::pin)) {
+    if (ledOnSince == 0) {
+      ledOnSince = now;
+    } else if (now - ledOnSince > 10000) {
+      summary("done");
+      exit(0);
+    }
+  } else {
+    ledOnSince = 0;
+  }
+  if (now > options.minutes * 60000) {
+    summary("time limit");
+    exit(1);
+  }
+
+  for (int pin = 0; pin < 64; pin++) {
+    if (attached[pin].handler) {
+      int level = digitalRead(pin);
+      if (level != attached[pin].level) {
+        attached[pin].level = level;
+        attached[pin].handler();
+      }
+    }
+  }
+}
+
+void parseOptions(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--rinse")) {
+      options.rinse = true;
+    } else if (!strcmp(argv[i], "--half")) {
+      options.half = true;
+    } else if (!strcmp(argv[i], "--verbose")) {
+      options.verbose = true;
+    } else if (!strcmp(argv[i], "--press") && i + 1 < argc) {
+      options.pressAt = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--inlet") && i + 1 < argc) {
+      options.inlet = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--dishes") && i + 1 < argc) {
+      options.dishes = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--dead") && i + 1 < argc) {
+      options.dead = argv[++i];
+    } else if (!strcmp(argv[i], "--stuck") && i + 1 < argc) {
+      options.stuck = argv[++i];
+    } else if (!strcmp(argv[i], "--leak") && i + 1 < argc) {
+      options.leakAt = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--door") && i + 1 < argc) {
+      options.doorAt = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--door-for") && i + 1 < argc) {
+      options.doorFor = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--bus") && i + 1 < argc) {
+      options.bus = argv[++i];
+    } else if (!strcmp(argv[i], "--telemetry") && i + 1 < argc) {
+      options.telemetry = argv[++i];
+    } else if (!strcmp(argv[i], "--address") && i + 1 < argc) {
+      options.address = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--speed") && i + 1 < argc) {
+      options.speed = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--clock") && i + 1 < argc) {
+      options.clock = strtoul(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--minutes") && i + 1 < argc) {
+      options.minutes = atof(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [--rinse | --half] [--press SECONDS] [--inlet CELSIUS] [--dishes KG] [--dead RELAY | level] [--stuck RELAY] [--leak SECONDS] [--door SECONDS [--door-for SECONDS]] [--bus DEVICE --address N [--speed FACTOR]] [--telemetry DEVICE] [--clock MILLIS] [--minutes MINUTES] [--verbose]\n", argv[0]);
+      exit(2);
+    }
+  }
+}
+
+}  // namespace
+
+void pinMode(uint8_t pin, uint8_t mode) {
+  if (mode == INPUT_PULLUP) {
+    levels[pin] = HIGH;
+  }
+}
+
+void digitalWrite(uint8_t pin, uint8_t level) {
+  levels[pin] = level;
+  for (Relay &relay : relays) {
+    bool on = level == relay.active || (relay.stuck && relay.on);
+    if (relay.pin == pin && relay.on != on) {
+      relay.on = on;
+      if (options.verbose || strcmp(relay.name, "led")) {
+        printf("%9.3f %s %s, %.2f l at %.1f C\n", now / 1000.0, relay.name, on ? "on" : "off", volume, temperature);
+      }
+    }
+  }
+}
+
+int digitalRead(uint8_t pin) {
+  if (pin == WATER_DISABLED_PIN) {
+    return sensedVolume() < LEVEL_SWITCH; // high when there is no water
+  }
+  if (pin == SWITCH_PIN) {
+    double held = options.rinse ? 3 : 0.3;
+    double seconds = now / 1000.0;
+    bool pressed = options.pressAt >= 0 && seconds >= options.pressAt && seconds < options.pressAt + held;
+    if (options.half) {
+      pressed = pressed || (seconds >= options.pressAt + 0.8 && seconds < options.pressAt + 0.8 + held);
+    }
+    return !pressed;
+  }
+  if (pin == DOOR_SWITCH_PIN) {
+    return isDoorOpen(); // the switch pulls the input low with the door shut
+  }
+  if (pin == LEAK_SENSOR_PIN) {
+    return !isLeaking(); // the float switch pulls the input low
+  }
+  return levels[pin];
+}
+
+int analogRead(uint8_t pin) {
+  if (pin == TEMP_SENSOR) {
+    return thermistorReading();
+  }
+#ifdef HEATER_CURRENT_PIN
+  if (pin == HEATER_CURRENT_PIN) {
+    return currentReading(isOn(HeaterRelay::pin) ? HEATER_AMPS : 0, HEATER_CURRENT_MV_PER_A);
+  }
+#endif
+#ifdef MAIN_PUMP_CURRENT_PIN
+  if (pin == MAIN_PUMP_CURRENT_PIN) {
+    return currentReading(isOn(MainPumpRelay::pin) ? MAIN_PUMP_AMPS : 0, MAIN_PUMP_CURRENT_MV_PER_A);
+  }
+#endif
+#ifdef DRAIN_CURRENT_PIN
+  if (pin == DRAIN_CURRENT_PIN) {
+    return currentReading(isOn(DrainRelay::pin) ? DRAIN_AMPS : 0, DRAIN_CURRENT_MV_PER_A);
+  }
+#endif
+#ifdef LEVEL_SENSOR_PIN
+  if (pin == LEVEL_SENSOR_PIN) {
+    return levelReading();
+  }
+#endif
+  return 0;
+}
+
+// Both wrap at 32 bits like on the boards, --clock sets where millis() starts.
+unsigned long millis() {
+  return (uint32_t)(options.clock + now);
+}
+
+unsigned long micros() {
+  return (uint32_t)((options.clock + now) * 1000);
+}
+
+void delay(unsigned long ms) {
+  while (ms--) {
+    step();
+  }
+}
+
+void tone(uint8_t, unsigned int, unsigned long duration) {
+  beeps++;
+  if (options.verbose) {
+    printf("%9.3f beep %lu ms\n", now / 1000.0, duration);
+  }
+}
+
+void attachInterrupt(int interrupt, void (*handler)(), int) {
+  attached[interrupt].handler = handler;
+  attached[interrupt].level = digitalRead(interrupt);
+}
+
+SimSerial Serial;
+
+void SimSerial::begin(unsigned long) {}
+
+int SimSerial::available() {
+  return pending(telemetryFd);
+}
+
+int SimSerial::read() {
+  return readByte(telemetryFd);
+}
+
+void SimSerial::print(const char *text) {
+  fputs(text, telemetryOut);
+}
+
+void SimSerial::print(char c) {
+  fputc(c, telemetryOut);
+}
+
+void SimSerial::print(long value) {
+  fprintf(telemetryOut, "%ld", value);
+}
+
+void SimSerial::print(unsigned long value) {
+  fprintf(telemetryOut, "%lu", value);
+}
+
+void SimSerial::print(double value, int digits) {
+  fprintf(telemetryOut, "%.*f", digits, value);
+}
+
+SimPort Serial1;
+
+void SimPort::begin(unsigned long) {}
+
+int SimPort::available() {
+  return pending(busFd);
+}
+
+int SimPort::read() {
+  return readByte(busFd);
+}
+
+size_t SimPort::write(const uint8_t *data, size_t length) {
+  return busFd >= 0 && ::write(busFd, data, length) > 0 ? length : 0;
+}
+
+uint8_t simBusAddress() {
+  return options.address;
+}
+
+void simIdle() {
+  step();
+}
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+  if (options.bus) {
+    busFd = openTerminal(options.bus);
+  }
+  if (options.telemetry) {
+    telemetryFd = openTerminal(options.telemetry);
+    telemetryOut = fdopen(telemetryFd, "w");
+    setvbuf(telemetryOut, nullptr, _IOLBF, 0);
+  }
+  wallStart = wallSeconds();
+  for (Relay &relay : relays) {
+    relay.dead = !strcmp(relay.name, options.dead);
+    relay.stuck = !strcmp(relay.name, options.stuck);
+  }
+  setup();
+  while (true) {
+    loop();
+  }
+}
+
+#endif
@@ -0,0 +1,57 @@
+#include <Arduino.h>
+#include "board.h"
+#include "hal.h"
+
+#if defined(WATER_DISABLED_PCINT_vect)
+// Inputs without an external interrupt use the per port pin change interrupts, the profile names the vectors.
+#include <avr/interrupt.h>
+
+ISR(WATER_DISABLED_PCINT_vect) {
+  onLevelChange();
+}
+
+ISR(SWITCH_PCINT_vect) {
+  onSwitchChange();
+}
+
+static void enablePinChangeInterrupt(unsigned char pin) {
+  *digitalPinToPCMSK(pin) |= bit(digitalPinToPCMSKbit(pin));
+  *digitalPinToPCICR(pin) |= bit(digitalPinToPCICRbit(pin));
+}
+
+void halSetupInterrupts() {
+  enablePinChangeInterrupt(WATER_DISABLED_PIN);
+  enablePinChangeInterrupt(SWITCH_PIN);
+  attachInterrupt(digitalPinToInterrupt(LEAK_SENSOR_PIN), onLeak, FALLING);
+}
+#else
+void halSetupInterrupts() {
+  attachInterrupt(digitalPinToInterrupt(WATER_DISABLED_PIN), onLevelChange, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(SWITCH_PIN), onSwitchChange, CHANGE);
+  attachInterrupt(digitalPinToInterrupt(LEAK_SENSOR_PIN), onLeak, FALLING);
+}
+#endif
+
+#if defined(__AVR__)
+#include <avr/sleep.h>
+
+void halIdle() {
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_mode();
+}
+#elif defined(ARDUINO_SIM)
+void halIdle() {
+  simIdle();
+}
+#elif defined(ARDUINO_ARCH_RP2040)
+#include <pico/time.h>
+
+// No periodic tick interrupt wakes the core here, a bare WFI could sleep until the next pin edge.
+// Wait for an event with a timer alarm as the backstop, same bound as the AVR millis() tick.
+void halIdle() {
+  best_effort_wfe_or_timeout(make_timeout_time_ms(1));
+}
+#else
+void halIdle() {
+}
+#endif
@@ -1,23 +1,22 @@
 #include <Arduino.h>
+#include "board.h"
+#include "current.h"
+#include "duration.h"
+#include "events.h"
+#include "hal.h"
+#include "hsm.h"
+#include "level.h"
+#include "load.h"
+#include "programs.h"
+#include "status.h"
+#include "powerbus.h"
+#include "pt.h"
+#include "stability.h"
+#include "telemetry.h"
+#include "thermal.h"
+#include "timer.h"
 
-// Relays: 
-//  1 - Water pump (WATER_LOAD_PIN)
-//  2 - Main pump
-//  3 - Drain pump
-//  4 - Dispenser
-//  H - Heater
-#define WATER_LOAD_PIN 6
-#define MAIN_PUMP_PIN 7
-#define DRAIN_PIN 4
-#define SOAP_PIN 3
-#define HEATER_PIN 8
-
-#define WATER_DISABLED_PIN 5
-#define TEMP_SENSOR A5
-
-#define LED_PIN 12
-#define SPEAKER_PIN 11
-#define SWITCH_PIN 10
+// Pins, relays and their active levels are defined by the board profile, see board.h.
 
 // Error codes
 #define GENERIC_ISSUE 1
@@ -25,6 +24,20 @@
 #define FAILED_LOAD_ISSUE 3
 #define TEMP_SENSOR_ISSUE 4
 #define FAILED_REACH_TEMP 5
+#define LEVEL_SENSOR_ISSUE 6
+#define RELAY_ISSUE 7
+#define NO_CURRENT_ISSUE 8
+#define LEAK_ISSUE 9
+
+// Boot self-test results, one bit per failed check.
+#define SELFTEST_SWITCH 0x01       // main switch pressed or stuck
+#define SELFTEST_TEMP_RANGE 0x02   // thermistor reading out of range, open or shorted
+#define SELFTEST_TEMP_NOISE 0x04   // thermistor readings too noisy to be trusted
+#define SELFTEST_WATER 0x08        // water in the tub, not a failure of the machine, a drain is needed
+#define SELFTEST_LEVEL 0x10        // level sensor reports water showing up while draining an empty tub
+#define SELFTEST_RELAY 0x20        // a relay with feedback doesn't follow its output, or current flows with all off
+#define SELFTEST_CURRENT 0x40      // the drain pump draws no current while pulsed
+#define SELFTEST_SLOW 0x80         // took longer than SELFTEST_BUDGET, reported only
 
 // Message codes
 #define WELCOME_MSG 2
@@ -32,49 +45,397 @@
 #define DRAIN_MSG 4
 
 // Times
-#define DRAIN_TIMEOUT 50000
-#define LOAD_TIMEOUT 200000
-#define HEATER_TIMEOUT 400000
+constexpr Seconds DRAIN_TIMEOUT(50);
+constexpr Seconds LOAD_TIMEOUT(200);
+constexpr Seconds HEATER_TIMEOUT(600);
+
+// A drain must finish well before a load could time out, and the heater must be able to
+// run for longer than a load so a cold fill still gets a chance to warm up.
+static_assert(DRAIN_TIMEOUT < LOAD_TIMEOUT, "DRAIN_TIMEOUT must be shorter than LOAD_TIMEOUT");
+static_assert(LOAD_TIMEOUT < HEATER_TIMEOUT, "HEATER_TIMEOUT must be longer than LOAD_TIMEOUT");
+static_assert(HEATER_TIMEOUT < Minutes(MAX_WASH_MINUTES), "HEATER_TIMEOUT must be shorter than the longest wash");
+
+// Period of the EVENT_TIMER_EXPIRED tick driving the program state machine.
+constexpr Milliseconds CONTROL_TICK(50);
+
+// A leak cuts inlet and heater from the interrupt, the emergency drain starts on the next pass of the loop
+// and the leak sensor is polled on every tick in case the interrupt was missed.
+constexpr Milliseconds LEAK_RESPONSE(50);
+static_assert(CONTROL_TICK <= LEAK_RESPONSE, "A leak must be handled within LEAK_RESPONSE");
+
+// How often the temperature is sampled while waiting for events.
+constexpr Milliseconds TEMPERATURE_SAMPLE_PERIOD(500);
+
+// Boot self-test, must stay within SELFTEST_BUDGET. Checked here for the worst case and measured on every boot.
+constexpr Milliseconds SELFTEST_BUDGET(3000);
+constexpr Milliseconds SELFTEST_DRAIN_PULSE(1000);
+constexpr Milliseconds SELFTEST_TEMP_INTERVAL(5);
+#define SELFTEST_TEMP_SAMPLES 16
+#define SELFTEST_TEMP_NOISE_LIMIT 8 // max - min thermistor reading, range is MIN/MAX_SENSOR_TEMPERATURE in programs.h
+
+// Drain pulse with a level check every 100 ms, temperature sampling and a couple of isLoaded() checks.
+static_assert(SELFTEST_DRAIN_PULSE.count() * 11 / 10 + SELFTEST_TEMP_INTERVAL.count() * SELFTEST_TEMP_SAMPLES + 100 +
+                      4 * CURRENT_WINDOW.count() <
+                  SELFTEST_BUDGET.count(),
+              "Boot self-test doesn't fit in SELFTEST_BUDGET");
+
+// The heater gets this much more than the expected heating time before giving up, HEATER_TIMEOUT at most.
+#define HEATING_TIME_FACTOR 1.5f
+constexpr Seconds HEATING_TIME_MARGIN(60);
+
+// Current sensors are optional, the board profile tells which ones are fitted.
+// Once CURRENT_SETTLE has passed since an actuator was switched, it must draw at least its minimum while on
+// and less than that while off.
+#if defined(HEATER_CURRENT_PIN) || defined(MAIN_PUMP_CURRENT_PIN) || defined(DRAIN_CURRENT_PIN)
+#define HAS_CURRENT_SENSORS
+#endif
+constexpr Seconds CURRENT_SETTLE(1);
+#define HEATER_MIN_MILLIAMPS 4000
+#define MAIN_PUMP_MIN_MILLIAMPS 200
+#define DRAIN_MIN_MILLIAMPS 100
+
+// Dispenser pulses, long enough for the solenoid or wax motor to trip the lid.
+constexpr Milliseconds SOAP_PULSE(200);
+constexpr Milliseconds RINSE_AID_PULSE(200);
+constexpr Seconds RINSE_AID_DELAY(60); // into the wash, once the water is hot and moving
+static_assert(RINSE_AID_DELAY < Minutes(MIN_RINSE_AID_MINUTES), "Rinse aid would come after the shortest wash using it");
+
+// Drying after the final drain: the full dryTime when the final rinse was DRY_COLD_CELSIUS or less,
+// a third of it from DRY_HOT_CELSIUS up, hot dishes flash off most of their water by themselves.
+#define DRY_COLD_CELSIUS 40.0f
+#define DRY_HOT_CELSIUS 60.0f
+constexpr Minutes VENT_PERIOD(3);
+constexpr Seconds VENT_OPEN(30); // let the steam out once every VENT_PERIOD
+
+// Switch presses closer than this to the previous release are contact bounce.
+constexpr Milliseconds SWITCH_DEBOUNCE(50);
+
+// The door is checked on every pass of the loop, so opening it stops everything within a CONTROL_TICK.
+// It has to stay closed for DOOR_CLOSE_SETTLE before the program carries on.
+constexpr Seconds DOOR_CLOSE_SETTLE(2);
+constexpr Milliseconds DOOR_RESTORE_STABILISE(500); // between high inrush outputs coming back
+
+// Shortest wash for steps ending on their thermal dose, the main pump needs some time to do its job.
+constexpr Minutes MIN_DOSE_WASH(1);
+
+// RS-485 bus, optional: the board profile names the port, its driver enable pin and the address of this machine.
+// It carries Modbus RTU register requests (see modbus.h and the register map in the readme) and the heater power
+// polls (see powerbus.h). A controller that was never polled for power has no coordinator and heats on its own.
+// Grants are leased: without polls renewing it for POWER_LEASE the grant goes, and the heat with it.
+#ifdef RS485_SERIAL
+#define HAS_RS485
+#ifndef RS485_BAUD
+#define RS485_BAUD 19200
+#endif
+#ifndef HEATER_WATTS
+#define HEATER_WATTS 2000
+#endif
+// Modbus RTU ends a frame after 3.5 characters of silence, 2 ms at 19200 baud, plus one for the millis() resolution.
+constexpr Milliseconds RS485_FRAME_GAP(3);
+#define RS485_MAX_REGISTERS 12 // per request
+#define RS485_BUFFER 40        // longer frames are for someone else
+static_assert(9 + 2 * RS485_MAX_REGISTERS <= RS485_BUFFER, "The longest register request doesn't fit in RS485_BUFFER");
+// Replies are sent out before the loop carries on, the longest one must not hold up a leak.
+static_assert((5 + 2 * RS485_MAX_REGISTERS) * 10000UL / RS485_BAUD < LEAK_RESPONSE.count(),
+              "The longest reply takes too long to send at RS485_BAUD");
+constexpr Seconds POWER_LEASE(POWER_LEASE_SECONDS);
+#endif
 
-// Modes
- #define RELAY_MODULE_OFF HIGH
- #define RELAY_MODULE_ON LOW
- #define LED_OFF HIGH
- #define LED_ON LOW
+// Longest wait for heater power, the step washes unheated after that.
+constexpr Minutes POWER_WAIT_TIMEOUT(20);
 
-// Shutdown everything that might be on, optionally delaying changes to avoid power spikes.
+// Part of the top-up window isLoaded() has to be good for, the pump makes it drop now and then.
+#define LOAD_STABLE_PERCENT 80
+
+#ifdef LEVEL_SENSOR_PIN
+// Closed loop levels with a pressure transducer, volumes in the tub as the sensor sees them.
+// The fill stops at FILL_MILLILITRES and tops up to it again once the main pump has taken its share up the pipes.
+#define FILL_MILLILITRES 2800
+#define EMPTY_MILLILITRES 100
+#define LEVEL_HYSTERESIS 50
+constexpr Milliseconds LEVEL_SAMPLE_PERIOD(100);
+constexpr Seconds LEVEL_STABLE_WINDOW(2);
+constexpr Seconds DRAIN_EXTRA(2); // pump out what is left below the sensor
+#define MIN_LEVEL_READING 20           // transducers have an offset, readings below this are a disconnected sensor
+#define LEVEL_SWITCH_MARGIN 400       // millilitres the sensor may read under LEVEL_SWITCH_MILLILITRES, its filter lags
+
+constexpr LevelPoint LEVEL_POINTS[] = LEVEL_CALIBRATION;
+static_assert(LEVEL_SWITCH_MILLILITRES > LEVEL_SWITCH_MARGIN, "LEVEL_SWITCH_MILLILITRES is below LEVEL_SWITCH_MARGIN");
+static_assert(isValidCalibration(LEVEL_POINTS), "LEVEL_CALIBRATION must go up in both reading and volume");
+static_assert(EMPTY_MILLILITRES + LEVEL_HYSTERESIS < FILL_MILLILITRES - LEVEL_HYSTERESIS,
+              "FILL_MILLILITRES and EMPTY_MILLILITRES are too close");
+#else
+// The level switch is well above the bottom, keep draining for a while once it goes off.
+constexpr Seconds DRAIN_EXTRA(10);
+#endif
+
+// Light loads are only told apart with a level sensor, for the top-up, and the load calibration of the machine
+// in the board profile. The heating rate alone is too close between a light and a full load to go by.
+#if defined(LEVEL_SENSOR_PIN) && defined(EMPTY_HEATING_RATE)
+#define HAS_LOAD_ESTIMATE
+#endif
+
+// Timings that can be tuned at runtime over Modbus (holding registers), back to the defaults on every boot.
+// A new value applies from the next time the timing is armed.
+struct Tunables {
+  Seconds drainTimeout;
+  Seconds loadTimeout;
+  Seconds heaterTimeout;
+  Seconds drainExtra;
+  Seconds rinseAidDelay;
+};
+
+constexpr Tunables DEFAULT_TUNABLES = { DRAIN_TIMEOUT, LOAD_TIMEOUT, HEATER_TIMEOUT, DRAIN_EXTRA, RINSE_AID_DELAY };
+
+// The same rules the defaults are checked against above.
+constexpr bool isValidTunables(const Tunables &t) {
+  return t.drainTimeout.count() > 0 && t.drainTimeout < t.loadTimeout && t.loadTimeout < t.heaterTimeout &&
+         t.heaterTimeout < Minutes(MAX_WASH_MINUTES) && t.drainExtra.count() > 0 && t.drainExtra < t.drainTimeout &&
+         t.rinseAidDelay < Minutes(MIN_RINSE_AID_MINUTES);
+}
+
+static_assert(isValidTunables(DEFAULT_TUNABLES), "Default timings must be valid tunables");
+
+Tunables tunables = DEFAULT_TUNABLES;
+
+// Switch off order, used by reset().
+// Make sure heater is the 1st one to be switched off, as it requires water movement to cold down.
+// Main pump is the last one to be switched off, main pump keeps the water level down, a reset might be followed by a drain process.
+// Only high inrush outputs are followed by the stabilise time.
+struct Shutdown {
+  void (*off)();
+  Inrush inrush;
+};
+
+const Shutdown SHUTDOWN_ORDER[] = {
+  { HeaterRelay::off, HeaterRelay::inrush },
+  { WaterLoadRelay::off, WaterLoadRelay::inrush },
+  { DrainRelay::off, DrainRelay::inrush },
+  { SoapRelay::off, SoapRelay::inrush },
+#ifdef HAS_RINSE_AID_RELAY
+  { RinseAidRelay::off, RinseAidRelay::inrush },
+#endif
+#ifdef HAS_VENT_RELAY
+  { VentRelay::off, VentRelay::inrush },
+#endif
+  { StatusLed::off, StatusLed::inrush },
+  { MainPumpRelay::off, MainPumpRelay::inrush },
+};
+
+Pt shutdownPt;
+Timer shutdownTimer;
+unsigned char shutdownIndex;
+int shutdownStabiliseTime;
+
+// Shutdown everything that might be on, waiting shutdownStabiliseTime between changes to avoid power spikes.
+PT_THREAD(shutdownThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  for (shutdownIndex = 0; shutdownIndex < sizeof(SHUTDOWN_ORDER) / sizeof(Shutdown); shutdownIndex++) {
+    SHUTDOWN_ORDER[shutdownIndex].off();
+    if (SHUTDOWN_ORDER[shutdownIndex].inrush == INRUSH_HIGH) {
+      PT_DELAY(pt, shutdownTimer, Milliseconds(shutdownStabiliseTime));
+    }
+  }
+  PT_END(pt);
+}
+
+// Start shutting everything down in the background, run shutdownThread() until it ends.
+void startShutdown(int stabiliseTime) {
+  shutdownStabiliseTime = stabiliseTime;
+  PT_INIT(&shutdownPt);
+}
+
+// Keep the bus answering while idling, used by everything that blocks.
+void idle();
+
+// Shutdown everything that might be on, blocking until done.
 void reset(int stabiliseTime = 0) {
-  // Make sure heater is the 1st one to be switched off, as it requires water movement to cold down.
-  digitalWrite(HEATER_PIN, LOW);
-  delay(stabiliseTime);
-  
-  // Shutdown anything that might be on.
-  digitalWrite(WATER_LOAD_PIN, RELAY_MODULE_OFF);
-  delay(stabiliseTime);
-  digitalWrite(DRAIN_PIN, RELAY_MODULE_OFF);
-  delay(stabiliseTime);
-  digitalWrite(SOAP_PIN, RELAY_MODULE_OFF);
-  delay(stabiliseTime);
-  digitalWrite(LED_PIN, LED_OFF);
-  delay(stabiliseTime);
-  
-  // Main pump is the last one to be switched off, main pump keeps the water level down, a reset might be followed by a drain process.
-  digitalWrite(MAIN_PUMP_PIN, RELAY_MODULE_OFF);
-  delay(stabiliseTime);
+  startShutdown(stabiliseTime);
+  while (shutdownThread(&shutdownPt) != PT_ENDED) {
+    idle();
+  }
+}
+
+// Dispensers, pulsed one after the other by dispenseThread().
+struct Dispenser {
+  unsigned char flag; // DISPENSE_*
+  void (*on)();
+  void (*off)();
+  Milliseconds pulse;
+};
+
+const Dispenser DISPENSERS[] = {
+  { DISPENSE_SOAP, SoapRelay::on, SoapRelay::off, SOAP_PULSE },
+#ifdef HAS_RINSE_AID_RELAY
+  { DISPENSE_RINSE_AID, RinseAidRelay::on, RinseAidRelay::off, RINSE_AID_PULSE },
+#endif
+};
+
+Pt dispensePt;
+Timer dispenseTimer;
+unsigned char dispenseIndex;
+unsigned char dispenseFlags;
+
+PT_THREAD(dispenseThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  for (dispenseIndex = 0; dispenseIndex < sizeof(DISPENSERS) / sizeof(Dispenser); dispenseIndex++) {
+    if (dispenseFlags & DISPENSERS[dispenseIndex].flag) {
+      DISPENSERS[dispenseIndex].on();
+      PT_DELAY(pt, dispenseTimer, DISPENSERS[dispenseIndex].pulse);
+      DISPENSERS[dispenseIndex].off();
+      PT_DELAY(pt, dispenseTimer, Seconds(1)); // stabilise
+    }
+  }
+  PT_END(pt);
 }
 
-// Do beeps.
+// Start pulsing the dispensers in flags (DISPENSE_*), run dispenseThread() until it ends.
+void startDispense(unsigned char flags) {
+  dispenseFlags = flags;
+  PT_INIT(&dispensePt);
+}
+
+#ifdef HAS_CURRENT_SENSORS
+struct CurrentCheck {
+  bool (*isOn)();
+  CurrentSensor sensor;
+  unsigned long minimum; // milliamps
+  bool commanded;
+  Timer changed;
+};
+
+CurrentCheck currentChecks[] = {
+#ifdef HEATER_CURRENT_PIN
+  { HeaterRelay::isOn, CurrentSensor(HEATER_CURRENT_PIN, HEATER_CURRENT_MV_PER_A), HEATER_MIN_MILLIAMPS, false, Timer() },
+#endif
+#ifdef MAIN_PUMP_CURRENT_PIN
+  { MainPumpRelay::isOn, CurrentSensor(MAIN_PUMP_CURRENT_PIN, MAIN_PUMP_CURRENT_MV_PER_A), MAIN_PUMP_MIN_MILLIAMPS, false, Timer() },
+#endif
+#ifdef DRAIN_CURRENT_PIN
+  { DrainRelay::isOn, CurrentSensor(DRAIN_CURRENT_PIN, DRAIN_CURRENT_MV_PER_A), DRAIN_MIN_MILLIAMPS, false, Timer() },
+#endif
+};
+
+// Mains current needs many samples per cycle, sensors are read on every pass of the wait loop.
+void sampleCurrents() {
+  for (CurrentCheck &check : currentChecks) {
+    check.sensor.sample();
+  }
+}
+
+void sampleCurrentsFor(Milliseconds duration) {
+  Timer sampling;
+  while (!sampling.hasElapsed(duration)) {
+    sampleCurrents();
+    delay(1);
+  }
+}
+
+// Actuators switched on must draw current, relays switched off must not let it through.
+// Returns the issue found, 0 when all is well.
+int checkCurrents() {
+  for (CurrentCheck &check : currentChecks) {
+    bool on = check.isOn();
+    if (on != check.commanded) {
+      check.commanded = on;
+      check.changed.restart();
+    }
+    if (!check.changed.hasElapsed(CURRENT_SETTLE)) {
+      continue;
+    }
+    bool drawing = check.sensor.milliamps() >= check.minimum;
+    if (on && !drawing) {
+      return NO_CURRENT_ISSUE;
+    }
+    if (!on && drawing) {
+      return RELAY_ISSUE;
+    }
+  }
+  return 0;
+}
+
+// Start over after switching things outside of the program, like the self-test does.
+void restartCurrentChecks() {
+  for (CurrentCheck &check : currentChecks) {
+    check.commanded = check.isOn();
+    check.changed.restart();
+  }
+}
+
+// Current of the actuator switched by the given isOn, 0 when it has no sensor.
+unsigned long currentOf(bool (*isOn)()) {
+  for (CurrentCheck &check : currentChecks) {
+    if (check.isOn == isOn) {
+      return check.sensor.milliamps();
+    }
+  }
+  return 0;
+}
+#endif
+
+// Beeps are queued and played in the background by beeperThread().
+struct BeepPattern {
+  unsigned char many; // 0 for a silent pause of delayLength
+  int length;
+  int delayLength;
+};
+
+BeepPattern beepQueue[4];
+unsigned char queuedBeeps = 0;
+unsigned char beepIndex;
+Pt beeperPt;
+Timer beeperTimer;
+
+PT_THREAD(beeperThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  while (true) {
+    PT_WAIT_UNTIL(pt, queuedBeeps > 0);
+    if (beepQueue[0].many == 0) {
+      PT_DELAY(pt, beeperTimer, Milliseconds(beepQueue[0].delayLength));
+    }
+    for (beepIndex = 0; beepIndex < beepQueue[0].many; beepIndex++) {
+      tone(SPEAKER_PIN, 1000, beepQueue[0].length);
+      PT_DELAY(pt, beeperTimer, Milliseconds(beepQueue[0].length + beepQueue[0].delayLength));
+    }
+    queuedBeeps--;
+    for (unsigned char i = 0; i < queuedBeeps; i++) {
+      beepQueue[i] = beepQueue[i + 1];
+    }
+  }
+  PT_END(pt);
+}
+
+// Do beeps. Beeps are only indicators, they are dropped if too many are already queued.
 void beep(int many, int length = 150, int delayLength = 50) {
-  for (int i = 0; i < many; i++) {
-    tone(SPEAKER_PIN, 1000, length);
-    delay(length + delayLength);
+  if (queuedBeeps < sizeof(beepQueue) / sizeof(BeepPattern)) {
+    beepQueue[queuedBeeps].many = many;
+    beepQueue[queuedBeeps].length = length;
+    beepQueue[queuedBeeps].delayLength = delayLength;
+    queuedBeeps++;
+  }
+}
+
+// Silence between beeps.
+void beepPause(int length) {
+  beep(0, 0, length);
+}
+
+bool isBeeping() {
+  return queuedBeeps > 0;
+}
+
+// Play every queued beep, blocking until done.
+void flushBeeps() {
+  while (isBeeping()) {
+    beeperThread(&beeperPt);
+    idle();
   }
 }
 
 // Report an issue with beeps.
 void beepError(int issue) {
   beep(10, 50, 50);
-  delay(100);
+  beepPause(100);
   beep(issue, 500, 300);
 }
 
@@ -84,15 +445,6 @@ void beepMessage(int message) {
   beep(message);
 }
 
-// Halt everything and report an issue forever.
-void crash(int issue) {
-  reset(500);
-  while (1) {
-    beepError(issue);
-    delay(2000);
-  }
-}
-
 // Check if minimum water level has been reached.
 bool isLoaded() {
   // test if is loaded for 10 milliseconds
@@ -110,191 +462,1446 @@ bool switchPressed() {
   return !digitalRead(SWITCH_PIN);
 }
 
-// Drain water by activating the drain pump for the defined until low level is reached + 10 seconds.
-void drain() {
-  reset(1000); // a working main pump keeps the water level down, reset() will turn the main pump off last so we can start the drain process any flooding.
-  digitalWrite(DRAIN_PIN, RELAY_MODULE_ON);
-  beepMessage(DRAIN_MSG);  
+// Events
+EventQueue<8> events;
+int watchedTemperature = 0; // thermistor reading to report with EVENT_TEMPERATURE_CROSSED, 0 when not watching
+Timer temperatureSampleTimer;
+long temperatureSum = 0;      // 4 times the filtered thermistor reading, 0 before the first sample
+ThermalDose dose;
+bool doseActive = false;
+
+// Input interrupts push level and switch changes as they happen, see hal.h.
+void onLevelChange() {
+  events.push(EVENT_LEVEL_CHANGED, digitalRead(WATER_DISABLED_PIN));
+}
 
-  unsigned long int drainStarts = millis();
-  while(isLoaded() && millis() - drainStarts < DRAIN_TIMEOUT) {
-    delay(1000);
-    beep(1, 300, 200); // indicate is draining      
+void onSwitchChange() {
+  events.push(EVENT_SWITCH, switchPressed());
+}
+
+// Aquastop float switch, pulled low by water in the base pan.
+bool isLeaking() {
+  return !digitalRead(LEAK_SENSOR_PIN);
+}
+
+// Water must stop coming in and start going out right away, whatever the program is doing, even after a crash.
+void onLeak() {
+  if (!isLeaking()) {
+    return; // noise
   }
+  WaterLoadRelay::off();
+  HeaterRelay::off();
+  DrainRelay::on();
+  events.push(EVENT_LEAK);
+}
 
-  delay(10000); // some fixed extra time after low level is reached
-  digitalWrite(DRAIN_PIN, RELAY_MODULE_OFF);
-  
-  // Water still available?, something is not ok, crash.
-  if (isLoaded()) {
-    crash(DRAIN_ISSUE);
+int reportedFault = 0; // issue STATE_FAULT is reporting, 0 until then
+
+// Halt everything and report reportedFault forever, with beeps and over the bus.
+// The drain pump is the only thing left running, to pump out the tub whenever the leak sensor sees water.
+void crash() {
+  int issue = reportedFault;
+  reset(500);
+  while (1) {
+    if (isLeaking() && isLoaded()) {
+      DrainRelay::on();
+    } else {
+      DrainRelay::off();
+    }
+    beepError(issue);
+    flushBeeps();
+    Timer pause;
+    while (!pause.hasElapsed(Seconds(2))) {
+      idle();
+    }
+  }
+}
+
+#ifdef LEVEL_SENSOR_PIN
+Timer levelSampleTimer;
+long levelSum = 0; // 4 times the filtered volume, 0 before the first sample
+
+// Water volume in the tub, averaged over the last few samples.
+unsigned int waterLevel() {
+  if (levelSum == 0) {
+    levelSum = 4L * levelMillilitres(LEVEL_POINTS, analogRead(LEVEL_SENSOR_PIN));
   }
+  return levelSum / 4;
+}
+
+void sampleLevel() {
+  if (!levelSampleTimer.hasElapsed(LEVEL_SAMPLE_PERIOD)) {
+    return;
+  }
+  levelSampleTimer.restart();
+  unsigned int sample = levelMillilitres(LEVEL_POINTS, analogRead(LEVEL_SENSOR_PIN));
+  levelSum = levelSum == 0 ? 4L * sample : levelSum - levelSum / 4 + sample;
+}
+#endif
+
+// Report with EVENT_TEMPERATURE_CROSSED once the thermistor reading goes above the given one, 0 to stop watching.
+void watchTemperature(int temperature) {
+  watchedTemperature = temperature;
+}
+
+// Thermistor reading averaged over the last few samples.
+int temperature() {
+  if (temperatureSum == 0) {
+    temperatureSum = 4L * analogRead(TEMP_SENSOR);
+  }
+  return temperatureSum / 4;
+}
+
+// The thermistor can't raise interrupts, it is sampled at a low rate while waiting.
+// Samples go through a moving average (1/4 weight) and the thermal dose integrates them while active.
+void sampleTemperature() {
+  Milliseconds dt = temperatureSampleTimer.elapsed();
+  if (dt < TEMPERATURE_SAMPLE_PERIOD) {
+    return;
+  }
+  temperatureSampleTimer.restart();
+  temperatureSum = temperatureSum == 0 ? 4L * analogRead(TEMP_SENSOR) : temperatureSum - temperatureSum / 4 + analogRead(TEMP_SENSOR);
+  int Vo = temperature();
+  if (doseActive) {
+    dose.add(thermistorCelsius(Vo), dt);
+  }
+  if (watchedTemperature > 0 && Vo > watchedTemperature) {
+    watchedTemperature = 0;
+    events.push(EVENT_TEMPERATURE_CROSSED, Vo);
+  }
+}
+
+#ifdef HAS_RS485
+// Modbus holding registers, read and write, in seconds.
+Seconds Tunables::*const HOLDING_REGISTERS[] = {
+  &Tunables::drainTimeout,  // 0
+  &Tunables::loadTimeout,   // 1
+  &Tunables::heaterTimeout, // 2
+  &Tunables::drainExtra,    // 3
+  &Tunables::rinseAidDelay, // 4
+};
+#define HOLDING_REGISTER_COUNT (sizeof(HOLDING_REGISTERS) / sizeof(HOLDING_REGISTERS[0]))
+
+// Modbus input registers, read only, they need the state machine further down.
+#define INPUT_REGISTER_COUNT 11
+unsigned short inputRegister(unsigned char index);
+
+unsigned char busFrame[RS485_BUFFER];
+unsigned char busLength = 0; // bytes received in the frame so far, may go past the buffer
+unsigned short busCrc;       // running CRC of every byte received in the frame, 0 once a whole valid one is in
+Timer busSilence;
+bool powerPolled = false; // a coordinator is on the bus, polls come within POWER_LEASE
+bool powerWanted = false;
+bool powerGranted = false;
+Timer powerPollTimer;  // since the last poll
+Timer powerGrantTimer; // since the last poll renewing the grant
+unsigned short powerRemaining = POWER_UNKNOWN_REMAINING;
+
+// Half duplex: drive the bus for the frame only. flush() returns once the last character is on the wire,
+// so the bus is let go of right away whatever the program does next, at the cost of waiting for the frame.
+void busSend(unsigned char length) {
+  digitalWrite(RS485_DE_PIN, HIGH);
+  RS485_SERIAL.write(busFrame, length);
+  RS485_SERIAL.flush();
+  digitalWrite(RS485_DE_PIN, LOW);
+}
+
+unsigned char answerPowerPoll() {
+  if (!powerPolled) {
+    powerPolled = true;
+    powerGrantTimer.restart(); // a grant held on our own gets a lease for the coordinator to learn about it
+  }
+  powerPollTimer.restart();
+  if (busFrame[2] && powerWanted && !powerGranted) {
+    powerGranted = true;
+    telemetry("power", "granted");
+  }
+  if (busFrame[2] && powerGranted) {
+    powerGrantTimer.restart();
+  }
+  PowerStatus status;
+  status.flags = (powerWanted ? POWER_WANTS : 0) | (powerGranted ? POWER_HOLDS : 0);
+  status.watts = HEATER_WATTS;
+  status.remaining = powerRemaining;
+  return powerStatus(busFrame, RS485_ADDRESS, status);
+}
+
+unsigned char readRegisters() {
+  bool input = busFrame[1] == MODBUS_READ_INPUT_REGISTERS;
+  unsigned short first = readWord(busFrame, 2);
+  unsigned short count = readWord(busFrame, 4);
+  if (count == 0 || count > RS485_MAX_REGISTERS) {
+    return modbusException(busFrame, MODBUS_ILLEGAL_DATA_VALUE);
+  }
+  if ((unsigned long)first + count > (input ? INPUT_REGISTER_COUNT : HOLDING_REGISTER_COUNT)) {
+    return modbusException(busFrame, MODBUS_ILLEGAL_DATA_ADDRESS);
+  }
+  busFrame[2] = count * 2;
+  for (unsigned char i = 0; i < count; i++) {
+    unsigned short value = input ? inputRegister(first + i) : (tunables.*HOLDING_REGISTERS[first + i]).count();
+    writeWord(busFrame, 3 + 2 * i, value);
+  }
+  return sealFrame(busFrame, 3 + 2 * count);
+}
+
+// Writes go to a copy first, they only apply if the timings still make sense together.
+unsigned char writeRegisters(unsigned char length) {
+  bool single = busFrame[1] == MODBUS_WRITE_SINGLE_REGISTER;
+  unsigned short first = readWord(busFrame, 2);
+  unsigned short count = single ? 1 : readWord(busFrame, 4);
+  unsigned char values = single ? 4 : 7;
+  if (count == 0 || count > RS485_MAX_REGISTERS || (!single && busFrame[6] != 2 * count)) {
+    return modbusException(busFrame, MODBUS_ILLEGAL_DATA_VALUE);
+  }
+  if ((unsigned long)first + count > HOLDING_REGISTER_COUNT) {
+    return modbusException(busFrame, MODBUS_ILLEGAL_DATA_ADDRESS);
+  }
+  Tunables updated = tunables;
+  for (unsigned char i = 0; i < count; i++) {
+    updated.*HOLDING_REGISTERS[first + i] = Seconds(readWord(busFrame, values + 2 * i));
+  }
+  if (!isValidTunables(updated)) {
+    return modbusException(busFrame, MODBUS_ILLEGAL_DATA_VALUE);
+  }
+  tunables = updated;
+  telemetry("tuned", first);
+  return single ? length : sealFrame(busFrame, 6); // a single write echoes the request
+}
+
+// Reply to the request in busFrame, returns its length, 0 for no reply.
+unsigned char answerRequest(unsigned char length) {
+  switch (busFrame[1]) {
+    case POWER_FUNCTION:
+      return answerPowerPoll();
+    case MODBUS_READ_HOLDING_REGISTERS:
+    case MODBUS_READ_INPUT_REGISTERS:
+      return readRegisters();
+    case MODBUS_WRITE_SINGLE_REGISTER:
+    case MODBUS_WRITE_MULTIPLE_REGISTERS:
+      return writeRegisters(length);
+  }
+  return modbusException(busFrame, MODBUS_ILLEGAL_FUNCTION);
+}
+
+// A lapsed grant is given back, and with no poll at all the coordinator is gone: back to heating on our own,
+// right away for a heat waiting on power.
+void checkPowerLease() {
+  if (!powerPolled) {
+    return;
+  }
+  if (powerGranted && powerGrantTimer.hasElapsed(POWER_LEASE)) {
+    powerGranted = false;
+    telemetry("power", "lapsed");
+  }
+  if (powerPollTimer.hasElapsed(POWER_LEASE)) {
+    powerPolled = false;
+    telemetry("power", "standalone");
+    powerGranted = powerWanted;
+  }
+}
+
+// Collect bytes as the serial receive interrupt buffers them and answer requests for our address.
+// A request for us is complete as soon as its length is known, anything else on the silence after it.
+// Broadcasts can only write registers and get no reply.
+void pollBus() {
+  while (RS485_SERIAL.available()) {
+    unsigned char c = RS485_SERIAL.read();
+    busCrc = crc16Update(busLength == 0 ? 0xFFFF : busCrc, c);
+    if (busLength < RS485_BUFFER) {
+      busFrame[busLength] = c;
+    }
+    if (busLength < 0xFF) {
+      busLength++;
+    }
+    busSilence.restart();
+  }
+  if (busLength == 0) {
+    return;
+  }
+  bool broadcast = busFrame[0] == MODBUS_BROADCAST;
+  bool ours = broadcast || busFrame[0] == RS485_ADDRESS;
+  unsigned char expected = 0;
+  if (busLength >= 2) {
+    expected = busFrame[1] == POWER_FUNCTION ? POWER_POLL_LENGTH : modbusRequestLength(busFrame, busLength);
+  }
+  if (!busSilence.hasElapsed(RS485_FRAME_GAP) && !(ours && expected > 0 && busLength >= expected)) {
+    return;
+  }
+  unsigned char length = busLength;
+  busLength = 0;
+  if (!ours) {
+    return;
+  }
+  // Too long to keep, but the running CRC tells a valid write of more registers than we take from noise.
+  if (length > RS485_BUFFER) {
+    if (!broadcast && busCrc == 0 && busFrame[1] == MODBUS_WRITE_MULTIPLE_REGISTERS) {
+      busSend(modbusException(busFrame, MODBUS_ILLEGAL_DATA_VALUE));
+    }
+    return;
+  }
+  if ((expected > 0 && length != expected) || !isValidFrame(busFrame, length)) {
+    return;
+  }
+  if (broadcast) {
+    if (busFrame[1] == MODBUS_WRITE_SINGLE_REGISTER || busFrame[1] == MODBUS_WRITE_MULTIPLE_REGISTERS) {
+      writeRegisters(length);
+    }
+    return;
+  }
+  busSend(answerRequest(length));
+}
+#endif
+
+// Ask for heater power, remaining is the expected heating time in seconds.
+void requestPower(unsigned short remaining) {
+#ifdef HAS_RS485
+  powerWanted = true;
+  powerRemaining = remaining;
+  if (!powerPolled) {
+    powerGranted = true; // no coordinator, counts as holding if one shows up
+  } else if (!powerGranted) {
+    telemetry("power", "waiting");
+  }
+#else
+  (void)remaining;
+#endif
+}
+
+bool hasPower() {
+#ifdef HAS_RS485
+  return powerGranted;
+#else
+  return true;
+#endif
+}
+
+void releasePower() {
+#ifdef HAS_RS485
+  powerWanted = false;
+  powerGranted = false;
+  powerRemaining = POWER_UNKNOWN_REMAINING;
+#endif
+}
+
+void idle() {
+#ifdef HAS_RS485
+  pollBus();
+  checkPowerLease();
+#endif
+  halIdle();
+}
+
+// Programs by number, as reported over Modbus and asked for by host tools.
+const Program *const PROGRAMS[] = { &REGULAR_PROGRAM, &LIGHT_PROGRAM, &RINSE_PROGRAM, &HALF_PROGRAM };
+const char *const PROGRAM_NAMES[] = { "regular", "light", "rinse", "half" };
+#define PROGRAM_COUNT (sizeof(PROGRAMS) / sizeof(PROGRAMS[0]))
+
+// Commands from host tools on the telemetry port, "start <program name>" is the only one so far.
+// A start only takes while idle, same as the switch.
+void readCommand() {
+  const char *command = telemetryCommand();
+  if (!command) {
+    return;
+  }
+  if (!strncmp(command, "start ", 6)) {
+    for (unsigned char i = 0; i < PROGRAM_COUNT; i++) {
+      if (!strcmp(command + 6, PROGRAM_NAMES[i])) {
+        events.push(EVENT_START, i + 1);
+        return;
+      }
+    }
+  }
+  telemetry("command_error", "unknown");
+}
+
+// Sleep until the next event or the given time, whatever comes first.
+// The CPU idles between interrupts, halIdle() returns at least every millisecond.
+template <unsigned long U>
+Event waitEvent(Duration<U> timeout) {
+  Timer waiting;
+  Event event;
+  while (!events.pop(event)) {
+    sampleTemperature();
+#ifdef LEVEL_SENSOR_PIN
+    sampleLevel();
+#endif
+#ifdef HAS_CURRENT_SENSORS
+    sampleCurrents();
+#endif
+    readCommand();
+    if (waiting.hasElapsed(timeout)) {
+      event.type = EVENT_TIMER_EXPIRED;
+      event.value = 0;
+      return event;
+    }
+    idle();
+  }
+  return event;
+}
+
+// Program context.
+const Program *program = nullptr; // nullptr while draining at startup
+unsigned char stepIndex = 0;
+float programDose = 0;
+float washEndCelsius = 0; // water temperature when the last wash ended
+#ifdef HAS_LOAD_ESTIMATE
+LoadEstimate load(EMPTY_HEATING_RATE, LIGHT_LOAD_HEATING_PERCENT, LIGHT_LOAD_TOP_UP_PERCENT);
+#endif
+int faultCode = GENERIC_ISSUE;
+
+// Phase context, only meaningful in the states using them.
+Timer phaseTimer;
+Timer indicatorTimer;
+Milliseconds loadTime;
+Milliseconds dryLength;
+Deadline<1000> loadTimeout(LOAD_TIMEOUT);
+Deadline<1000> drainTimeout(DRAIN_TIMEOUT);
+Deadline<1> heaterTimeout(toMillis(HEATER_TIMEOUT));
+Deadline<60000> powerTimeout(POWER_WAIT_TIMEOUT);
+StabilityDetector loaded(Milliseconds(0));
+#ifdef LEVEL_SENSOR_PIN
+AnalogStabilityDetector filled(FILL_MILLILITRES - LEVEL_HYSTERESIS, LEVEL_HYSTERESIS, LEVEL_STABLE_WINDOW, LOAD_STABLE_PERCENT);
+#endif
+bool heating = false;
+float inletCelsius = 0; // water temperature at the end of the fill
+float heatingRate = 0;  // centigrades per second learned from previous heats, 0 until known
+bool temperatureReached = false;
+
+// Sequential part of the current phase, restarted by the entry of each state using it.
+Pt phasePt;
+Timer phaseDelay;
+unsigned char presses = 0;
+Timer switchReleased;
+
+Step step() {
+  return readStep(*program, stepIndex);
+}
+
+bool isTick(const Event &event) {
+  return event.type == EVENT_TIMER_EXPIRED;
+}
+
+// True once every given time, used to pace beeps and blinks.
+template <unsigned long U>
+bool indicatorDue(Duration<U> period) {
+  if (!indicatorTimer.hasElapsed(period)) {
+    return false;
+  }
+  indicatorTimer.restart();
+  return true;
+}
+
+StateId fail(int issue) {
+  faultCode = issue;
+  return STATE_FAULT;
+}
+
+// Door interlock.
+// Opening the door holds the program where it is: whatever it had on goes off at once and its timers stop,
+// so a wash carries on with the time it had left. Once the door is closed again the outputs come back
+// one by one, water moving before the heater.
+struct HeldOutput {
+  bool (*isOn)();
+  void (*on)();
+  void (*off)();
+  Inrush inrush;
+};
+
+const HeldOutput HELD_OUTPUTS[] = {
+  { DrainRelay::isOn, DrainRelay::on, DrainRelay::off, DrainRelay::inrush },
+  { WaterLoadRelay::isOn, WaterLoadRelay::on, WaterLoadRelay::off, WaterLoadRelay::inrush },
+  { MainPumpRelay::isOn, MainPumpRelay::on, MainPumpRelay::off, MainPumpRelay::inrush },
+  { HeaterRelay::isOn, HeaterRelay::on, HeaterRelay::off, HeaterRelay::inrush },
+  { SoapRelay::isOn, SoapRelay::on, SoapRelay::off, SoapRelay::inrush },
+#ifdef HAS_RINSE_AID_RELAY
+  { RinseAidRelay::isOn, RinseAidRelay::on, RinseAidRelay::off, RinseAidRelay::inrush },
+#endif
+#ifdef HAS_VENT_RELAY
+  { VentRelay::isOn, VentRelay::on, VentRelay::off, VentRelay::inrush },
+#endif
+};
+
+static_assert(sizeof(HELD_OUTPUTS) / sizeof(HeldOutput) <= 8, "heldOutputs has one bit per output");
+
+bool doorHeld = false;
+unsigned char heldOutputs; // bit per HELD_OUTPUTS entry that was on
+bool heldDoseActive;
+Timer doorClosed;
+Pt doorPt;
+Timer doorDelay;
+unsigned char doorIndex;
+
+// A broken wire reads as an open door.
+bool doorOpen() {
+  return digitalRead(DOOR_SWITCH_PIN);
+}
+
+// Every timer a program phase might be waiting on.
+// Level readings taken with the door open tell nothing about the level with the main pump running,
+// the fill detectors start over once everything is back.
+void holdTimers(bool hold) {
+  if (hold) {
+    phaseTimer.pause();
+    phaseDelay.pause();
+    dispenseTimer.pause();
+    shutdownTimer.pause();
+    loadTimeout.pause();
+    drainTimeout.pause();
+    heaterTimeout.pause();
+    powerTimeout.pause();
+  } else {
+    phaseTimer.resume();
+    phaseDelay.resume();
+    dispenseTimer.resume();
+    shutdownTimer.resume();
+    loadTimeout.resume();
+    drainTimeout.resume();
+    heaterTimeout.resume();
+    powerTimeout.resume();
+    loaded.restart();
+#ifdef LEVEL_SENSOR_PIN
+    filled.restart();
+#endif
+  }
+}
+
+void holdProgram() {
+  heldOutputs = 0;
+  for (unsigned char i = 0; i < sizeof(HELD_OUTPUTS) / sizeof(HeldOutput); i++) {
+    if (HELD_OUTPUTS[i].isOn()) {
+      heldOutputs |= 1 << i;
+    }
+  }
+  heldDoseActive = doseActive;
+  doseActive = false; // nothing is sprayed with the door open
+  holdTimers(true);
+  doorHeld = true;
+  telemetry("door", "open");
+  beep(2, 80);
+}
+
+// Wait for the door to settle closed and switch back on what the program had on.
+PT_THREAD(doorThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  PT_WAIT_UNTIL(pt, doorClosed.hasElapsed(DOOR_CLOSE_SETTLE));
+  for (doorIndex = 0; doorIndex < sizeof(HELD_OUTPUTS) / sizeof(HeldOutput); doorIndex++) {
+    if (heldOutputs & (1 << doorIndex)) {
+      HELD_OUTPUTS[doorIndex].on();
+      if (HELD_OUTPUTS[doorIndex].inrush == INRUSH_HIGH) {
+        PT_DELAY(pt, doorDelay, DOOR_RESTORE_STABILISE);
+      }
+    }
+  }
+  PT_END(pt);
+}
+
+// Called on every pass of the loop while a program runs, true while the program is held by the door.
+bool doorHolds() {
+  if (doorOpen()) {
+    if (!doorHeld) {
+      holdProgram();
+    }
+    for (const HeldOutput &output : HELD_OUTPUTS) {
+      output.off(); // again if the door opened while they were coming back
+    }
+    doorClosed.restart();
+    PT_INIT(&doorPt);
+    return true;
+  }
+  if (!doorHeld) {
+    return false;
+  }
+  if (doorThread(&doorPt) == PT_WAITING) {
+    return true;
+  }
+  doseActive = heldDoseActive;
+  holdTimers(false);
+  doorHeld = false;
+  telemetry("door", "closed");
+  return false;
+}
+
+// Move on to the next step of the program, or finish.
+// The first step tells how full the machine is, a light load carries on with the light variant.
+StateId nextStep() {
+  if (program == nullptr) {
+    return STATE_IDLE;
+  }
+#ifdef HAS_LOAD_ESTIMATE
+  if (stepIndex == 0 && program->light) {
+    telemetry("load", load.isLight() ? "light" : "full");
+    if (load.isLight()) {
+      program = program->light;
+    }
+  }
+#endif
+  stepIndex++;
+  if (stepIndex < program->count) {
+    return STATE_CYCLE;
+  }
+  return program->dryTime.count() > 0 ? STATE_DRY : STATE_DONE;
+}
+
+StateId startProgram(const Program *selected) {
+  program = selected;
+  stepIndex = 0;
+  programDose = 0;
+#ifdef HAS_LOAD_ESTIMATE
+  load.reset();
+#endif
+  return STATE_PROGRAM;
+}
+
+StateId idleHandle(const Event &event) {
+  // wait for user action
+  if ((event.type == EVENT_SWITCH && event.value) || (isTick(event) && switchPressed())) {
+    return STATE_SELECT;
+  }
+  if (event.type == EVENT_START && event.value >= 1 && event.value <= (int)PROGRAM_COUNT) {
+    telemetry("start", PROGRAM_NAMES[event.value - 1]);
+    beep(3);
+    return startProgram(PROGRAMS[event.value - 1]);
+  }
+  return HANDLED;
+}
+
+void selectEntry() {
+  beep(3); // action detected
+  presses = 1;
+  switchReleased.restart();
+  PT_INIT(&phasePt);
+}
+
+PT_THREAD(selectThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  PT_WAIT_WHILE(pt, isBeeping());
+  PT_DELAY(pt, phaseDelay, Seconds(2));
+  PT_END(pt);
+}
+
+StateId selectHandle(const Event &event) {
+  // Count presses until the selection ends, a press right after a release is bounce.
+  if (event.type == EVENT_SWITCH) {
+    if (!event.value) {
+      switchReleased.restart();
+    } else if (switchReleased.hasElapsed(SWITCH_DEBOUNCE)) {
+      presses++;
+    }
+    return HANDLED;
+  }
+  // if the switch still pressed after 2 seconds, is alternative program
+  if (!isTick(event) || selectThread(&phasePt) == PT_WAITING) {
+    return HANDLED;
+  }
+  if (switchPressed()) {
+    // rinse program
+    beep(5, 80);
+    program = &RINSE_PROGRAM;
+  } else if (presses > 1) {
+    // half load program
+    beep(4, 80);
+    program = &HALF_PROGRAM;
+  } else {
+    // regular wash program
+    program = &REGULAR_PROGRAM;
+  }
+  return startProgram(program);
+}
+
+void programExit() {
+  reset();
+  doorHeld = false;
 }
 
 // Load water and start main pump when base level is reached.
 // Continue loading for 1 loading time (double level).
-// Start main pump and continue loading for 2/3 loading time.
-// Continue loading until base level is recovered (and a little bit more).
-void load() {
-  reset(200); // make sure everything is off
+// Start main pump and continue loading until base level is recovered (and a little bit more).
+// With a level sensor the fill goes straight to FILL_MILLILITRES and tops up back to it.
+void fillExit() {
+  // Loading done.
+  WaterLoadRelay::off();
+#ifdef LEVEL_SENSOR_PIN
+  telemetry("volume", (long)waterLevel());
+#endif
+
+  // The thermistor has been under running inlet water since the base level, that's our inlet temperature.
+  inletCelsius = thermistorCelsius(temperature());
+  telemetry("inlet", inletCelsius);
+}
+
+void fillBaseEntry() {
+  PT_INIT(&phasePt);
+}
+
+#ifdef LEVEL_SENSOR_PIN
+unsigned int fillMillilitres() {
+  return (unsigned long)FILL_MILLILITRES * program->fill / 100;
+}
+#endif
+
+#ifdef LEVEL_SENSOR_PIN
+// The level switch backs the sensor up while filling: closed well below its volume, or with a reading gone
+// below MIN_LEVEL_READING, the sensor can't be trusted to stop the inlet.
+bool levelSensorFailed() {
+  return analogRead(LEVEL_SENSOR_PIN) < MIN_LEVEL_READING ||
+         (waterLevel() + LEVEL_SWITCH_MARGIN < LEVEL_SWITCH_MILLILITRES && isLoaded());
+}
+#endif
+
+bool isFilled() {
+#ifdef LEVEL_SENSOR_PIN
+  return waterLevel() >= fillMillilitres();
+#else
+  return isLoaded();
+#endif
+}
+
+PT_THREAD(fillBaseThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  startShutdown(200); // make sure everything is off
+  PT_WAIT_UNTIL(pt, shutdownThread(&shutdownPt) == PT_ENDED);
   beepMessage(LOAD_MSG);
   
   // Start loading process.
-  unsigned long int loadStarts = millis();
-  digitalWrite(WATER_LOAD_PIN, RELAY_MODULE_ON);
-  
+  phaseTimer.restart();
+  loadTimeout.arm(tunables.loadTimeout);
+  WaterLoadRelay::on();
+
   // Wait until water reaches base level or timeout.
-  while(!isLoaded() && millis() - loadStarts < LOAD_TIMEOUT) {
-    delay(10);
+  PT_WAIT_UNTIL(pt, isFilled() || loadTimeout.expired());
+  PT_END(pt);
+}
+
+StateId fillBaseHandle(const Event &event) {
+  if (event.type != EVENT_LEVEL_CHANGED && !isTick(event)) {
+    return UNHANDLED;
+  }
+#ifdef LEVEL_SENSOR_PIN
+  if (levelSensorFailed()) {
+    return fail(LEVEL_SENSOR_ISSUE);
+  }
+#endif
+  if (fillBaseThread(&phasePt) == PT_WAITING) {
+    return HANDLED;
+  }
+  if (isFilled()) {
+    // Calculate a base level loadTime.
+    //  loadTime is the time the water took to reach the base and minimum level, detected by isLoaded().
+    // The maximum water capacity is around 3 times the base level.
+    loadTime = phaseTimer.elapsed();
+#ifdef LEVEL_SENSOR_PIN
+    return STATE_FILL_TOP_UP; // already at the full level
+#else
+    return STATE_FILL_DOUBLE;
+#endif
   }
-  
   // Timed out but there is no water?, crash with failed to load error.
   // Mind that isLoaded() can be unstable and return a false negative
   // is only a failure if we have a negative AND a timeout.
-  if (!isLoaded() && millis() - loadStarts >= LOAD_TIMEOUT) {
-    crash(FAILED_LOAD_ISSUE);
-  }
-  
-  // Calculate a base level loadTime.
-  //  loadTime is the time the water took to reach the base and minimum level, detected by isLoaded().
-  // The maximum water capacity is around 3 times the base level.
-  unsigned long int loadTime = millis() - loadStarts;
-  
+  return fail(FAILED_LOAD_ISSUE);
+}
+
+void fillDoubleEntry() {
   // With loadTime defined, we can now double the current water level.
-  loadStarts = millis();
-  while (millis() - loadStarts < loadTime) {
+  phaseTimer.restart();
+}
+
+StateId fillDoubleHandle(const Event &event) {
+  if (!isTick(event)) {
+    return UNHANDLED;
+  }
+  // The base level is half of the full level, lower fills load for a part of loadTime.
+  if (phaseTimer.hasElapsed(Milliseconds(loadTime.count() * (2 * program->fill - 100) / 100))) {
+    return STATE_FILL_TOP_UP;
+  }
+  if (indicatorDue(Seconds(1))) {
     beep(1, 80);
-    delay(1000);
   }
-  
+  return HANDLED;
+}
+
+void fillTopUpEntry() {
   // With double the base level, is ok to initiate water movement by starting the main pump.
-  digitalWrite(MAIN_PUMP_PIN, RELAY_MODULE_ON);
+  MainPumpRelay::on();
 
   // Main pump will move the water up the pipes causing a drop in level, isLoaded() will be unstable and can't be trusted. 
-  // To ensure we get enough water, we continue the load until we see isLoaded() stable for at least 1/4 of the base time.
-  loadStarts = millis();
-  while (millis() - loadStarts < (loadTime / 4)) {
+  // To ensure we get enough water, we continue the load until we see isLoaded() mostly stable for at least 1/4 of the base time.
+  // The top-up never takes longer than another base loadTime, keeping us below the ~3 times base level capacity.
+  loaded = StabilityDetector(loadTime / 4, LOAD_STABLE_PERCENT);
+#ifdef LEVEL_SENSOR_PIN
+  // The level sensor does better, top up until the full level holds with the pump running.
+  filled = AnalogStabilityDetector(fillMillilitres() - LEVEL_HYSTERESIS, LEVEL_HYSTERESIS, LEVEL_STABLE_WINDOW,
+                                   LOAD_STABLE_PERCENT);
+#endif
+  phaseTimer.restart();
+}
+
+bool isToppedUp() {
+#ifdef LEVEL_SENSOR_PIN
+  // The valve follows the level, so nothing is added while we wait for it to hold.
+  filled.update(waterLevel());
+  WaterLoadRelay::set(!filled.isOn());
+  return filled.isStable();
+#else
+  loaded.update(isLoaded());
+  return loaded.isStable();
+#endif
+}
+
+StateId fillTopUpHandle(const Event &event) {
+  if (!isTick(event)) {
+    return UNHANDLED;
+  }
+#ifdef LEVEL_SENSOR_PIN
+  if (levelSensorFailed()) {
+    return fail(LEVEL_SENSOR_ISSUE);
+  }
+#endif
+  if (isToppedUp() || phaseTimer.hasElapsed(loadTime)) {
+#ifdef LEVEL_SENSOR_PIN
+    if (stepIndex == 0) {
+#ifdef HAS_LOAD_ESTIMATE
+      load.addTopUp(loadTime, phaseTimer.elapsed());
+#endif
+      telemetry("top_up_percent", (long)(phaseTimer.elapsed().count() * 100 / loadTime.count()));
+    }
+#endif
+    return STATE_HEAT;
+  }
+  if (indicatorDue(Seconds(1))) {
     beep(2, 50);
-    delay(800);
+  }
+  return HANDLED;
+}
+
+// Thermal dose of a step counts from the start of heating to the end of the wash.
+void heatEntry() {
+  temperatureReached = false;
+  dose.reset();
+  doseActive = true;
+  PT_INIT(&phasePt);
+}
+
+void heatExit() {
+  watchTemperature(0);
+  HeaterRelay::off();
+  releasePower();
+}
+
+// Expected time from the inlet to the step temperature plus some margin, so once the heating rate is known
+// a dead heater is noticed well before HEATER_TIMEOUT.
+Milliseconds heatingTimeLimit() {
+  if (heatingRate <= 0) {
+    return toMillis(tunables.heaterTimeout);
+  }
+  float expected = (thermistorCelsius(step().temperature) - inletCelsius) / heatingRate;
+  telemetry("heat_expected", expected);
+  Milliseconds limit = Seconds((unsigned long)(expected * HEATING_TIME_FACTOR)) + HEATING_TIME_MARGIN;
+  return limit < tunables.heaterTimeout ? limit : toMillis(tunables.heaterTimeout);
+}
 
-    // no water at this moment? reset the timer
-    if (!isLoaded()) {
-      loadStarts = millis();
+// Heating time left from the current temperature, in seconds, POWER_UNKNOWN_REMAINING until the rate is known.
+unsigned short expectedHeatingSeconds() {
+  if (heatingRate <= 0) {
+    return POWER_UNKNOWN_REMAINING;
+  }
+  float seconds = (thermistorCelsius(step().temperature) - thermistorCelsius(temperature())) / heatingRate;
+  if (seconds <= 0) {
+    return 0;
+  }
+  return seconds < POWER_UNKNOWN_REMAINING ? (unsigned short)seconds : POWER_UNKNOWN_REMAINING - 1;
+}
+
+// Heating rate of the heat just finished, averaged with the previous ones.
+// A heat that timed out still tells how fast the water was warming up.
+void learnHeatingRate() {
+  float seconds = phaseTimer.elapsed().count() / 1000.0f;
+  telemetry("heat_time", seconds);
+  if (seconds > 0) {
+    float rate = (thermistorCelsius(temperature()) - inletCelsius) / seconds;
+    heatingRate = heatingRate > 0 ? (heatingRate + rate) / 2 : rate;
+    if (stepIndex == 0) {
+#ifdef HAS_LOAD_ESTIMATE
+      load.addHeating(rate * program->fill / 100);
+#endif
+      telemetry("heat_rate", rate * 60); // centigrades per minute
     }
   }
-  
-  // Loading done.
-  digitalWrite(WATER_LOAD_PIN, RELAY_MODULE_OFF);
-  delay(1000); // stabilise
 }
 
-// Load water and run main pump up to given time.
 // Release soap and enable heater if required.
-void cycle(unsigned long int  washTime, bool soap = false, long int temperature = 0) {
-  int Vo;
-  load();
-  delay(2000); // stabilise
+// Wash time only starts once the temperature is reached, or the heater timed out.
+PT_THREAD(heatThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  PT_DELAY(pt, phaseDelay, Seconds(3)); // stabilise after loading
   
-  if (soap) {
-    digitalWrite(SOAP_PIN, RELAY_MODULE_ON);
-    delay(200);
-    digitalWrite(SOAP_PIN, RELAY_MODULE_OFF);
-    delay(1000); // stabilise
-  }
+  startDispense(step().dispense & DISPENSE_SOAP);
+  PT_WAIT_UNTIL(pt, dispenseThread(&dispensePt) == PT_ENDED);
   
   // Enable heater at start of the cycle if temp below required.
   // We don't turn it ON again when temperature goes down.
-  Vo = analogRead(TEMP_SENSOR);
-  if (temperature > 0 && Vo < temperature) {
-    digitalWrite(HEATER_PIN, HIGH);
-    delay(1000); // stabilise
+  // Hot inlet water may already be there.
+  heating = step().temperature > 0 && temperature() <= step().temperature &&
+            thermistorCelsius(step().temperature) > inletCelsius;
+  if (heating) {
+    // Other machines on the circuit may be heating, the wait is not part of the heating time.
+    requestPower(expectedHeatingSeconds());
+    powerTimeout.arm();
+    PT_WAIT_UNTIL(pt, hasPower() || powerTimeout.expired());
+    heating = hasPower();
+    if (!heating) {
+      telemetry("power", "timeout");
+      releasePower();
+    }
   }
-  
-  unsigned long int cycleStarts = millis();
-  unsigned long int washStarts = millis();
-  while((washTime * 60 * 1000) >  millis() - washStarts) {
-    // Turn off the heater once desired temperature is reached.
-    if (Vo > temperature || (millis() - cycleStarts) > HEATER_TIMEOUT) { // OR
-      digitalWrite(HEATER_PIN, LOW);
-    } else {
-      Vo = analogRead(TEMP_SENSOR);
+  if (heating) {
+    HeaterRelay::on();
+    PT_DELAY(pt, phaseDelay, Seconds(1)); // stabilise
+    watchTemperature(step().temperature);
+    heaterTimeout.arm(heatingTimeLimit());
+    phaseTimer.restart();
+    // A grant lapsing on the way ends the heat like a timeout would.
+    PT_WAIT_UNTIL(pt, temperatureReached || heaterTimeout.expired() || !hasPower());
+    learnHeatingRate();
+  }
+  PT_END(pt);
+}
+
+StateId heatHandle(const Event &event) {
+  if (event.type == EVENT_TEMPERATURE_CROSSED) {
+    temperatureReached = true;
+  }
+  if (heatThread(&phasePt) == PT_ENDED) {
+    return STATE_WASH;
+  }
+  if (heating && isTick(event) && indicatorDue(Seconds(4))) {
+    beep(1, 300, 200); // indicate is heating
+  }
+  return HANDLED;
+}
+
+void washEntry() {
+  phaseTimer.restart();
+  PT_INIT(&phasePt);
+}
+
+void washExit() {
+  washEndCelsius = thermistorCelsius(temperature());
+  doseActive = false;
+  programDose += dose.value();
+  telemetry("dose", dose.value());
+}
+
+// Run main pump up to the step wash time.
+// Steps with a dose target end as soon as the dose is met, hot water makes for a shorter wash,
+// and can go on up to twice the wash time when the water is colder than expected.
+bool washDone() {
+  if (step().dose == 0) {
+    return phaseTimer.hasElapsed(step().washTime);
+  }
+  return (dose.value() >= step().dose && phaseTimer.hasElapsed(MIN_DOSE_WASH)) ||
+         phaseTimer.hasElapsed(step().washTime + step().washTime);
+}
+
+// Boards without a rinse aid dispenser run those steps as plain washes, see the board profile.
+bool dosesRinseAid() {
+#ifdef HAS_RINSE_AID_RELAY
+  return step().dispense & DISPENSE_RINSE_AID;
+#else
+  return false;
+#endif
+}
+
+// Rinse aid goes in a while into the wash.
+PT_THREAD(washThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  if (dosesRinseAid()) {
+    PT_WAIT_UNTIL(pt, phaseTimer.hasElapsed(tunables.rinseAidDelay));
+    startDispense(DISPENSE_RINSE_AID);
+    PT_WAIT_UNTIL(pt, dispenseThread(&dispensePt) == PT_ENDED);
+  }
+  PT_WAIT_UNTIL(pt, washDone());
+  PT_END(pt);
+}
+
+StateId washHandle(const Event &event) {
+  if (!isTick(event)) {
+    return UNHANDLED;
+  }
+  if (washThread(&phasePt) == PT_ENDED) {
+    return STATE_DRAIN;
+  }
+  if (indicatorDue(Seconds(2))) {
+    StatusLed::on();
+    StatusLed::off();
+  }
+  return HANDLED;
+}
+
+// Drain water by activating the drain pump until low level is reached + DRAIN_EXTRA.
+void drainExit() {
+  DrainRelay::off();
+}
+
+void drainLevelEntry() {
+  PT_INIT(&phasePt);
+}
+
+bool isEmpty() {
+#ifdef LEVEL_SENSOR_PIN
+  return waterLevel() <= EMPTY_MILLILITRES && !isLoaded();
+#else
+  return !isLoaded();
+#endif
+}
+
+PT_THREAD(drainLevelThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  startShutdown(1000); // a working main pump keeps the water level down, shutdown turns the main pump off last so we can start the drain process any flooding.
+  PT_WAIT_UNTIL(pt, shutdownThread(&shutdownPt) == PT_ENDED);
+  DrainRelay::on();
+  beepMessage(DRAIN_MSG);  
+  drainTimeout.arm(tunables.drainTimeout);
+  PT_WAIT_UNTIL(pt, isEmpty() || drainTimeout.expired());
+  PT_END(pt);
+}
 
-      washStarts = millis(); // reset start time until temperature is reached
-      delay(2000);
-      beep(1, 300, 200); // indicate is heating      
+StateId drainLevelHandle(const Event &event) {
+  if (event.type != EVENT_LEVEL_CHANGED && !isTick(event)) {
+    return UNHANDLED;
+  }
+  if (drainLevelThread(&phasePt) == PT_ENDED) {
+    return STATE_DRAIN_EXTRA;
+  }
+  if (isTick(event) && indicatorDue(Seconds(1))) {
+    beep(1, 300, 200); // indicate is draining
+  }
+  return HANDLED;
+}
+
+void drainExtraEntry() {
+  phaseTimer.restart();
+}
+
+StateId drainExtraHandle(const Event &event) {
+  if (!isTick(event) || !phaseTimer.hasElapsed(tunables.drainExtra)) {
+    return HANDLED;
+  }
+  // Water still available?, something is not ok, crash.
+  if (!isEmpty()) {
+    return fail(DRAIN_ISSUE);
+  }
+  return nextStep();
+}
+
+// Dishes dry on the heat left from the final rinse, no heater involved.
+// The hotter the rinse ended, the shorter the drying. The switch ends it early.
+Milliseconds dryTime() {
+  float cold = (DRY_HOT_CELSIUS - washEndCelsius) / (DRY_HOT_CELSIUS - DRY_COLD_CELSIUS);
+  cold = cold < 0 ? 0 : (cold > 1 ? 1 : cold);
+  return Milliseconds((unsigned long)(program->dryTime.toMillis() * (1 + 2 * cold) / 3));
+}
+
+void dryEntry() {
+  dryLength = dryTime();
+  telemetry("dry_time", (long)(dryLength.count() / 1000));
+  phaseTimer.restart();
+  PT_INIT(&phasePt);
+}
+
+PT_THREAD(ventThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  while (true) {
+    PT_DELAY(pt, phaseDelay, VENT_PERIOD);
+#ifdef HAS_VENT_RELAY
+    VentRelay::on();
+#endif
+    PT_DELAY(pt, phaseDelay, VENT_OPEN);
+#ifdef HAS_VENT_RELAY
+    VentRelay::off();
+#endif
+  }
+  PT_END(pt);
+}
+
+StateId dryHandle(const Event &event) {
+  if (event.type == EVENT_SWITCH && event.value) {
+    return STATE_DONE;
+  }
+  if (!isTick(event)) {
+    return HANDLED;
+  }
+  if (phaseTimer.hasElapsed(dryLength)) {
+    return STATE_DONE;
+  }
+  ventThread(&phasePt);
+  if (indicatorDue(Seconds(4))) {
+    StatusLed::on();
+    StatusLed::off();
+  }
+  return HANDLED;
+}
+
+void doneEntry() {
+  StatusLed::on();
+  telemetry("program_dose", programDose);
+}
+
+StateId doneHandle(const Event &) {
+  if (!isBeeping()) {
+    beep(20, 50);
+    beepPause(100);
+  }
+  return HANDLED;
+}
+
+// Stop everything and pump out all the water we can, the leak is reported once the tub is empty.
+void leakEntry() {
+  reset();
+  DrainRelay::on();
+  drainTimeout.arm(tunables.drainTimeout);
+  PT_INIT(&phasePt);
+}
+
+PT_THREAD(leakThread(Pt *pt)) {
+  PT_BEGIN(pt);
+  PT_WAIT_UNTIL(pt, isEmpty() || drainTimeout.expired());
+  PT_DELAY(pt, phaseDelay, tunables.drainExtra);
+  PT_END(pt);
+}
+
+StateId leakHandle(const Event &event) {
+  if (!isTick(event)) {
+    return HANDLED;
+  }
+  if (leakThread(&phasePt) == PT_ENDED) {
+    return fail(LEAK_ISSUE);
+  }
+  if (indicatorDue(Seconds(1))) {
+    beep(3, 50, 50);
+  }
+  return HANDLED;
+}
+
+// Only records the issue, loop() runs crash() once the state change has been reported.
+void faultEntry() {
+  reportedFault = faultCode;
+  telemetry("fault", faultCode);
+}
+
+const StateDef<Event> STATES[] PROGMEM = {
+  // parent         initial            entry            exit          handle
+  { NO_STATE,       NO_STATE,          nullptr,         nullptr,      idleHandle },        // STATE_IDLE
+  { NO_STATE,       NO_STATE,          selectEntry,     nullptr,      selectHandle },      // STATE_SELECT
+  { NO_STATE,       STATE_CYCLE,       nullptr,         programExit,  nullptr },           // STATE_PROGRAM
+  { STATE_PROGRAM,  STATE_FILL,        nullptr,         nullptr,      nullptr },           // STATE_CYCLE
+  { STATE_CYCLE,    STATE_FILL_BASE,   nullptr,         fillExit,     nullptr },           // STATE_FILL
+  { STATE_FILL,     NO_STATE,          fillBaseEntry,   nullptr,      fillBaseHandle },    // STATE_FILL_BASE
+  { STATE_FILL,     NO_STATE,          fillDoubleEntry, nullptr,      fillDoubleHandle },  // STATE_FILL_DOUBLE
+  { STATE_FILL,     NO_STATE,          fillTopUpEntry,  nullptr,      fillTopUpHandle },   // STATE_FILL_TOP_UP
+  { STATE_CYCLE,    NO_STATE,          heatEntry,       heatExit,     heatHandle },        // STATE_HEAT
+  { STATE_CYCLE,    NO_STATE,          washEntry,       washExit,     washHandle },        // STATE_WASH
+  { STATE_CYCLE,    STATE_DRAIN_LEVEL, nullptr,         drainExit,    nullptr },           // STATE_DRAIN
+  { STATE_DRAIN,    NO_STATE,          drainLevelEntry, nullptr,      drainLevelHandle },  // STATE_DRAIN_LEVEL
+  { STATE_DRAIN,    NO_STATE,          drainExtraEntry, nullptr,      drainExtraHandle },  // STATE_DRAIN_EXTRA
+  { STATE_PROGRAM,  NO_STATE,          dryEntry,        nullptr,      dryHandle },         // STATE_DRY
+  { NO_STATE,       NO_STATE,          doneEntry,       nullptr,      doneHandle },        // STATE_DONE
+  { NO_STATE,       NO_STATE,          leakEntry,       drainExit,    leakHandle },        // STATE_LEAK
+  { NO_STATE,       NO_STATE,          faultEntry,      nullptr,      nullptr },           // STATE_FAULT
+};
+
+static_assert(sizeof(STATES) / sizeof(STATES[0]) == STATE_COUNT, "STATES must describe every State");
+
+Hsm<Event> machine(STATES);
+Timer tickTimer;
+
+bool neverOn() {
+  return false;
+}
+
+// Bit per output, in OUTPUT_NAMES order.
+bool (*const REPORTED_OUTPUTS[])() = {
+  WaterLoadRelay::isOn, MainPumpRelay::isOn, DrainRelay::isOn, HeaterRelay::isOn, SoapRelay::isOn,
+#ifdef HAS_RINSE_AID_RELAY
+  RinseAidRelay::isOn,
+#else
+  neverOn, // keeps the vent on its bit
+#endif
+#ifdef HAS_VENT_RELAY
+  VentRelay::isOn,
+#endif
+};
+
+static_assert(sizeof(REPORTED_OUTPUTS) / sizeof(REPORTED_OUTPUTS[0]) <= OUTPUT_COUNT, "OUTPUT_NAMES misses outputs");
+
+unsigned char outputBits() {
+  unsigned char bits = 0;
+  for (unsigned char i = 0; i < sizeof(REPORTED_OUTPUTS) / sizeof(REPORTED_OUTPUTS[0]); i++) {
+    bits |= REPORTED_OUTPUTS[i]() ? 1 << i : 0;
+  }
+  return bits;
+}
+
+StateId reportedState = NO_STATE;
+unsigned char reportedOutputs = 0xFF; // not a valid combination, the first pass reports
+
+// State and output changes, host tools rebuild the program timeline from these.
+void reportStatus() {
+  if (machine.state() != reportedState) {
+    reportedState = machine.state();
+    telemetry("state", (int)reportedState);
+  }
+  unsigned char outputs = outputBits();
+  if (outputs != reportedOutputs) {
+    reportedOutputs = outputs;
+    telemetry("outputs", (int)outputs);
+  }
+}
+
+unsigned char selfTestResult = 0; // SELFTEST_* bits of the boot self-test
+Milliseconds selfTestTime;        // how long it took, 0 when skipped
 
+#ifdef HAS_RS485
+
+// Status as the building management sees it instead of listening for beep codes, see the readme for the map.
+unsigned short inputRegister(unsigned char index) {
+  unsigned short value = 0;
+  switch (index) {
+    case 0:
+      return machine.state();
+    case 1:
+      for (unsigned char i = 0; i < PROGRAM_COUNT; i++) {
+        value = program == PROGRAMS[i] ? i + 1 : value;
+      }
+      return value;
+    case 2:
+      return program ? stepIndex : 0;
+    case 3:
+      return outputBits();
+    case 4: {
+      float celsius = thermistorCelsius(temperature());
+      return celsius > 0 ? (unsigned short)(celsius * 10 + 0.5f) : 0;
     }
-    
-    delay(2000);
-    digitalWrite(LED_PIN, LED_ON);
-    
-    // delay(1000);
-    digitalWrite(LED_PIN, LED_OFF);
+    case 5:
+      return (digitalRead(WATER_DISABLED_PIN) ? 0 : 1) | (isLeaking() ? 2 : 0) | (doorOpen() ? 4 : 0);
+    case 6:
+#ifdef LEVEL_SENSOR_PIN
+      return waterLevel();
+#else
+      return 0xFFFF;
+#endif
+    case 7:
+      return reportedFault;
+    case 8:
+      return (unsigned short)(programDose * 10 + 0.5f);
+    case 9:
+      return selfTestResult;
+    case 10:
+      return selfTestTime.count();
   }
+  return 0;
+}
+#endif
 
-  drain();
+// Relays with feedback must be off after a reset, a welded contact would show here.
+template <class RELAY>
+bool relayIsStuck() {
+  return RELAY::hasFeedback() && RELAY::isEnergized();
+}
+
+// Fast checks of sensors and actuators, returns the failed SELFTEST_* bits.
+unsigned char selfTest() {
+  unsigned char failed = 0;
+  Timer budget;
+
+  // The main switch should not be pressed at startup.
+  if (switchPressed()) {
+    failed |= SELFTEST_SWITCH;
+  }
+
+  // Thermistor should be in range and quiet, water temperature doesn't move in a few milliseconds.
+  int lowest = 1023;
+  int highest = 0;
+  for (int i = 0; i < SELFTEST_TEMP_SAMPLES; i++) {
+    int Vo = analogRead(TEMP_SENSOR);
+    lowest = Vo < lowest ? Vo : lowest;
+    highest = Vo > highest ? Vo : highest;
+    delay(SELFTEST_TEMP_INTERVAL.count());
+  }
+  if (lowest < MIN_SENSOR_TEMPERATURE || highest > MAX_SENSOR_TEMPERATURE) {
+    failed |= SELFTEST_TEMP_RANGE;
+  } else if (highest - lowest > SELFTEST_TEMP_NOISE_LIMIT) {
+    failed |= SELFTEST_TEMP_NOISE;
+  }
+
+  if (relayIsStuck<WaterLoadRelay>() || relayIsStuck<MainPumpRelay>() || relayIsStuck<DrainRelay>() ||
+      relayIsStuck<SoapRelay>() || relayIsStuck<HeaterRelay>()) {
+    failed |= SELFTEST_RELAY;
+  }
+#ifdef HAS_RINSE_AID_RELAY
+  if (relayIsStuck<RinseAidRelay>()) {
+    failed |= SELFTEST_RELAY;
+  }
+#endif
+
+  // Pulse the drain pump: the relay must follow and, on an empty tub, the level sensor must keep reporting no water.
+  // Water showing up means a stuck level sensor or a leaking inlet valve.
+  bool water = isLoaded();
+  if (water) {
+    failed |= SELFTEST_WATER;
+  }
+#ifdef HAS_CURRENT_SENSORS
+  // Everything is off, any current is a welded relay.
+  sampleCurrentsFor(CURRENT_WINDOW + CURRENT_WINDOW);
+  for (CurrentCheck &check : currentChecks) {
+    if (check.sensor.milliamps() >= check.minimum) {
+      failed |= SELFTEST_RELAY;
+    }
+  }
+#endif
+  DrainRelay::on();
+  Timer pulse;
+  while (!pulse.hasElapsed(SELFTEST_DRAIN_PULSE)) {
+    delay(100);
+    if (!water && isLoaded()) {
+      failed |= SELFTEST_LEVEL;
+    }
+  }
+  if (DrainRelay::hasFeedback() && !DrainRelay::isEnergized()) {
+    failed |= SELFTEST_RELAY;
+  }
+#ifdef DRAIN_CURRENT_PIN
+  sampleCurrentsFor(CURRENT_WINDOW + CURRENT_WINDOW);
+  if (currentOf(DrainRelay::isOn) < DRAIN_MIN_MILLIAMPS) {
+    failed |= SELFTEST_CURRENT;
+  }
+#endif
+  DrainRelay::off();
+
+#ifdef LEVEL_SENSOR_PIN
+  if (analogRead(LEVEL_SENSOR_PIN) < MIN_LEVEL_READING) {
+    failed |= SELFTEST_LEVEL;
+  }
+#endif
+
+  selfTestTime = budget.elapsed();
+  if (selfTestTime > SELFTEST_BUDGET) {
+    failed |= SELFTEST_SLOW;
+  }
+  return failed;
 }
 
 // Set pins modes and startup checks.
 void setup() {
   pinMode(WATER_DISABLED_PIN, INPUT);     
-  pinMode(LED_PIN, OUTPUT);     
-  pinMode(WATER_LOAD_PIN, OUTPUT);     
-  pinMode(DRAIN_PIN, OUTPUT);     
-  pinMode(MAIN_PUMP_PIN, OUTPUT);     
-  pinMode(HEATER_PIN, OUTPUT);    
+  StatusLed::setup();
+  WaterLoadRelay::setup();
+  DrainRelay::setup();
+  MainPumpRelay::setup();
+  HeaterRelay::setup();
+#ifdef HAS_VENT_RELAY
+  VentRelay::setup();
+#endif
   pinMode(TEMP_SENSOR, INPUT);  
-  pinMode(SOAP_PIN, OUTPUT);     
+  SoapRelay::setup();
+#ifdef HAS_RINSE_AID_RELAY
+  RinseAidRelay::setup();
+#endif
   pinMode(SPEAKER_PIN, OUTPUT);     
   pinMode(SWITCH_PIN, INPUT_PULLUP);     
+  pinMode(LEAK_SENSOR_PIN, INPUT_PULLUP);
+  pinMode(DOOR_SWITCH_PIN, INPUT_PULLUP);
   
   reset(); // Make sure everything is off.
+  telemetryBegin();
+#ifdef HAS_RS485
+  pinMode(RS485_DE_PIN, OUTPUT);
+  digitalWrite(RS485_DE_PIN, LOW);
+  RS485_SERIAL.begin(RS485_BAUD);
+#endif
 
-  // The main switch should not be pressed at startup.
-  if (switchPressed()) {
-    crash(GENERIC_ISSUE);
-  }
-  
-  // We should have no water at startup.
-  if (isLoaded()) {
-    // error and try to drain
-    beepError(DRAIN_ISSUE);
-    drain();
+  halSetupInterrupts();
+
+  // Water in the base pan already, drain right away and leave the self-test for the next boot.
+  if (isLeaking()) {
+#ifdef HAS_CURRENT_SENSORS
+    restartCurrentChecks();
+#endif
+    machine.start(STATE_LEAK);
+    return;
   }
 
-  if (analogRead(TEMP_SENSOR) < 500) {
-    crash(TEMP_SENSOR_ISSUE);
+  selfTestResult = selfTest();
+#ifdef HAS_CURRENT_SENSORS
+  restartCurrentChecks();
+#endif
+  telemetry("selftest", (int)selfTestResult);
+  telemetry("selftest_ms", (long)selfTestTime.count());
+  int issue = 0;
+  if (selfTestResult & SELFTEST_SWITCH) {
+    issue = GENERIC_ISSUE;
+  } else if (selfTestResult & (SELFTEST_TEMP_RANGE | SELFTEST_TEMP_NOISE)) {
+    issue = TEMP_SENSOR_ISSUE;
+  } else if (selfTestResult & SELFTEST_RELAY) {
+    issue = RELAY_ISSUE;
+  } else if (selfTestResult & SELFTEST_CURRENT) {
+    issue = NO_CURRENT_ISSUE;
+  } else if (selfTestResult & SELFTEST_LEVEL) {
+    issue = LEVEL_SENSOR_ISSUE;
+  }
+  if (issue) {
+    machine.start(fail(issue));
+    return;
   }
   
   // Welcome beeps
   beepMessage(WELCOME_MSG);
+
+  // We should have no water at startup.
+  if (selfTestResult & SELFTEST_WATER) {
+    // error and try to drain
+    beepError(DRAIN_ISSUE);
+    machine.start(STATE_DRAIN);
+  } else {
+    machine.start(STATE_IDLE);
+  }
 }
 
+// Dispatch events as they come, plus a tick (EVENT_TIMER_EXPIRED) every CONTROL_TICK even while events keep coming.
 void loop() {
-  // wait for user action
-  while (!switchPressed()) {
-    delay(100);
+  Milliseconds sinceTick = tickTimer.elapsed();
+  Event event;
+  if (sinceTick >= CONTROL_TICK) {
+    event.type = EVENT_TIMER_EXPIRED;
+    event.value = 0;
+  } else {
+    event = waitEvent(Milliseconds(CONTROL_TICK.count() - sinceTick.count()));
   }
-  beep(3); // action detected
-  
-  // if the switch still pressed after 2 seconds, is alternative program
-  delay(2000);
-  if (switchPressed())  {
-    // rinse program
-    beep(5, 80);
-    cycle(5, false, 0);
+  if (isTick(event)) {
+    tickTimer.restart();
+  }
+  // A leak takes over from any other state, checked here so no state can miss it.
+  // An open door holds a running program, the only event it keeps is the heat phase reaching its temperature.
+  // A fault keeps its state, crash() drains on a leak itself.
+  if ((event.type == EVENT_LEAK || (isTick(event) && isLeaking())) && !machine.isIn(STATE_LEAK) &&
+      !machine.isIn(STATE_FAULT)) {
+    machine.transition(STATE_LEAK);
+  } else if (machine.isIn(STATE_PROGRAM) && doorHolds()) {
+    if (event.type == EVENT_TEMPERATURE_CROSSED) {
+      temperatureReached = true;
+    }
   } else {
-    // regular wash program
-    cycle(3, false, 910); // temperature is defined by the reading of a thermistor, no fancy centigrades conversion here
-    cycle(12, true, 910);
-    cycle(3, false, 910);
-    cycle(3, false, 0);
+    machine.dispatch(event);
   }
-  
-  // done
-  digitalWrite(LED_PIN, LED_ON);
-  while (true) {
-    beep(20, 50);
-    delay(100);
+#ifdef HAS_CURRENT_SENSORS
+  int issue = isTick(event) ? checkCurrents() : 0;
+  if (issue) {
+    machine.transition(fail(issue));
+  }
+#endif
+  beeperThread(&beeperPt);
+  reportStatus();
+  if (machine.isIn(STATE_FAULT)) {
+    crash();
   }
 }
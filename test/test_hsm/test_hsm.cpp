@@ -0,0 +1,129 @@
+// Host test for the state machine in hsm.h: pio test -e native
+#include <string.h>
+#include <unity.h>
+#include "hsm.h"
+
+// Two top level states, the first one with a nested composite:
+//   A (initial A1)
+//     A1
+//     A2 (initial A2a)
+//       A2a
+//   B
+enum { A, A1, A2, A2A, B, COUNT };
+
+typedef int Event; // state to move to, HANDLED or UNHANDLED, as the handler on the receiving state should return
+
+char trace[128];
+int handledBy;
+
+void record(const char *step) {
+  strcat(trace, step);
+  strcat(trace, " ");
+}
+
+void enterA() { record("+A"); }
+void exitA() { record("-A"); }
+void enterA1() { record("+A1"); }
+void exitA1() { record("-A1"); }
+void enterA2() { record("+A2"); }
+void exitA2() { record("-A2"); }
+void enterA2a() { record("+A2a"); }
+void exitA2a() { record("-A2a"); }
+void enterB() { record("+B"); }
+void exitB() { record("-B"); }
+
+// Leaves pass everything up, composites act on it.
+StateId passUp(const Event &) { return UNHANDLED; }
+
+StateId handleA(const Event &event) {
+  handledBy = A;
+  return event;
+}
+
+StateId handleA2(const Event &event) {
+  handledBy = A2;
+  return event == B ? UNHANDLED : event; // B is for A to decide
+}
+
+const StateDef<Event> TABLE[] = {
+  // parent   initial   entry     exit     handle
+  { NO_STATE, A1,       enterA,   exitA,   handleA },  // A
+  { A,        NO_STATE, enterA1,  exitA1,  passUp },   // A1
+  { A,        A2A,      enterA2,  exitA2,  handleA2 }, // A2
+  { A2,       NO_STATE, enterA2a, exitA2a, nullptr },  // A2A
+  { NO_STATE, NO_STATE, enterB,   exitB,   nullptr },  // B
+};
+
+static_assert(sizeof(TABLE) / sizeof(TABLE[0]) == COUNT, "TABLE must describe every state");
+
+Hsm<Event> machine(TABLE);
+
+void setUp() {
+  machine.start(A);
+  trace[0] = '\0';
+  handledBy = NO_STATE;
+}
+
+void tearDown() {}
+
+void test_start_enters_initial_substates() {
+  machine.start(A);
+  TEST_ASSERT_EQUAL_STRING("+A +A1 ", trace);
+  TEST_ASSERT_EQUAL(A1, machine.state());
+  TEST_ASSERT_TRUE(machine.isIn(A));
+  TEST_ASSERT_FALSE(machine.isIn(A2));
+}
+
+void test_transition_stops_at_common_ancestor() {
+  machine.transition(A2A);
+  TEST_ASSERT_EQUAL_STRING("-A1 +A2 +A2a ", trace);
+  TEST_ASSERT_EQUAL(A2A, machine.state());
+
+  trace[0] = '\0';
+  machine.transition(B);
+  TEST_ASSERT_EQUAL_STRING("-A2a -A2 -A +B ", trace);
+  TEST_ASSERT_EQUAL(B, machine.state());
+}
+
+void test_unhandled_event_bubbles_to_parent() {
+  machine.dispatch(A2);
+  TEST_ASSERT_EQUAL(A, handledBy);
+  TEST_ASSERT_EQUAL_STRING("-A1 +A2 +A2a ", trace);
+
+  // A2 passes B up to A, the transition starts from the leaf all the same.
+  trace[0] = '\0';
+  machine.dispatch(B);
+  TEST_ASSERT_EQUAL(A, handledBy);
+  TEST_ASSERT_EQUAL_STRING("-A2a -A2 -A +B ", trace);
+}
+
+void test_handled_event_stops_at_first_handler() {
+  machine.transition(A2A);
+  trace[0] = '\0';
+  machine.dispatch(HANDLED);
+  TEST_ASSERT_EQUAL(A2, handledBy);
+  TEST_ASSERT_EQUAL_STRING("", trace);
+  TEST_ASSERT_EQUAL(A2A, machine.state());
+}
+
+void test_self_transition_exits_and_reenters() {
+  machine.transition(A1);
+  TEST_ASSERT_EQUAL_STRING("-A1 +A1 ", trace);
+  TEST_ASSERT_EQUAL(A1, machine.state());
+
+  // Targeting an ancestor exits and re-enters it, then follows its initial substate.
+  trace[0] = '\0';
+  machine.transition(A);
+  TEST_ASSERT_EQUAL_STRING("-A1 -A +A +A1 ", trace);
+  TEST_ASSERT_EQUAL(A1, machine.state());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_start_enters_initial_substates);
+  RUN_TEST(test_transition_stops_at_common_ancestor);
+  RUN_TEST(test_unhandled_event_bubbles_to_parent);
+  RUN_TEST(test_handled_event_stops_at_first_handler);
+  RUN_TEST(test_self_transition_exits_and_reenters);
+  return UNITY_END();
+}
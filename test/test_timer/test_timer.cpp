@@ -0,0 +1,54 @@
+// Host test for timer.h across a millis() rollover: pio test -e native
+#include <stdint.h>
+#include <unity.h>
+#include "timer.h"
+
+// The fakeClock the timers read, 32 bits as on the boards.
+uint32_t fakeClock;
+
+unsigned long millis() { return fakeClock; }
+
+const uint32_t BEFORE_WRAP = 0xFFFFFFFFUL - 500;
+
+void setUp() { fakeClock = BEFORE_WRAP; }
+void tearDown() {}
+
+void test_timer_counts_across_wrap() {
+  Timer timer;
+  fakeClock += 1000; // 499 after the wrap
+  TEST_ASSERT_EQUAL(1000, timer.elapsed().count());
+  TEST_ASSERT_TRUE(timer.hasElapsed(Seconds(1)));
+  TEST_ASSERT_FALSE(timer.hasElapsed(Milliseconds(1001)));
+}
+
+void test_deadline_expires_across_wrap() {
+  Deadline<1000> deadline(Seconds(2));
+  deadline.arm();
+  fakeClock += 1999;
+  TEST_ASSERT_FALSE(deadline.expired());
+  fakeClock += 1;
+  TEST_ASSERT_TRUE(deadline.expired());
+
+  // Stays expired however far the fakeClock goes.
+  fakeClock += 0x80000000UL;
+  TEST_ASSERT_TRUE(deadline.expired());
+}
+
+void test_paused_timer_holds_across_wrap() {
+  Timer timer;
+  fakeClock += 300;
+  timer.pause();
+  fakeClock += 60000; // wraps while paused
+  TEST_ASSERT_EQUAL(300, timer.elapsed().count());
+  timer.resume();
+  fakeClock += 200;
+  TEST_ASSERT_EQUAL(500, timer.elapsed().count());
+}
+
+int main() {
+  UNITY_BEGIN();
+  RUN_TEST(test_timer_counts_across_wrap);
+  RUN_TEST(test_deadline_expires_across_wrap);
+  RUN_TEST(test_paused_timer_holds_across_wrap);
+  return UNITY_END();
+}
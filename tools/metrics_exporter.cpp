@@ -0,0 +1,531 @@
+// Prometheus metrics for a fleet of controllers, from their telemetry (see include/telemetry.h and status.h).
+//
+//   metrics_exporter (--port NAME=DEVICE ... [--baud BAUD] | --pty COUNT) [--listen PORT] [--heater-watts WATTS]
+//
+// Reads the telemetry ports and serves http://127.0.0.1:PORT/metrics (9464 by default) with, per controller:
+//
+//   dishwasher_phase_seconds               histogram of fill, heat, wash, drain and dry phase durations
+//   dishwasher_heating_rate                histogram of the learned heating rates, centigrades per minute
+//   dishwasher_heater_energy_joules_total  counter, heater on time times --heater-watts (2000)
+//   dishwasher_programs_total              counter of programs done
+//   dishwasher_faults_total                counter by fault code, leaks and door openings have their own
+//   dishwasher_state                       gauge, State number of the last state line
+//
+// Samples go into their buckets as the lines come in, a scrape only prints counters: its cost grows with the
+// number of controllers and buckets, never with how long the exporter has been running.
+//
+// With --pty every controller gets a pseudo terminal, printed at startup, for simulated controllers:
+//
+//   dishwasher --telemetry /dev/pts/N --speed 20
+//
+// Build with: g++ -std=gnu++11 -O2 -Wall -Iinclude tools/metrics_exporter.cpp -o metrics_exporter
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "serial_util.h"
+#include "status.h"
+
+namespace {
+
+const int MAX_CONTROLLERS = 64;
+const int MAX_CLIENTS = 8;
+const size_t LINE_BUFFER = 512;
+const size_t REQUEST_BUFFER = 1024;
+const int MAX_FAULT = 32; // fault codes are beeped, they stay small
+const int MAX_BUCKETS = 12;
+
+// epoll tags, controllers are tagged with their index.
+const uint32_t LISTEN_TAG = 0xFFFF0000;
+const uint32_t CLIENT_TAG = 0xFFFF0100; // plus the client index
+
+const char *const PHASES[] = { "fill", "heat", "wash", "drain", "dry" };
+const int PHASE_COUNT = sizeof(PHASES) / sizeof(PHASES[0]);
+const double PHASE_BOUNDS[] = { 10, 30, 60, 120, 300, 600, 900, 1200, 1800, 2700, 3600 };
+const double RATE_BOUNDS[] = { 1, 2, 4, 6, 8, 10, 12, 15, 20 };
+
+struct Histogram {
+  unsigned long buckets[MAX_BUCKETS]; // counts per bucket, not cumulative, the last one is +Inf
+  double sum;
+  unsigned long count;
+};
+
+struct Controller {
+  const char *name;
+  const char *device;
+  int fd;
+  int slaveFd; // --pty keeps its own end open, the master would hang up whenever a controller goes away
+  char line[LINE_BUFFER];
+  size_t used;
+  bool skipping;
+
+  // Timeline, in controller milliseconds.
+  unsigned long lastMillis;
+  int state;              // -1 until the first state line
+  int phase;              // index in PHASES, -1 outside a phase
+  unsigned long phaseSince;
+  bool heaterOn;
+  unsigned long heaterSince;
+
+  Histogram phases[PHASE_COUNT];
+  Histogram heatingRate;
+  double heaterJoules;
+  unsigned long programs;
+  unsigned long faults[MAX_FAULT + 1]; // the last one counts codes out of range
+  unsigned long leaks;
+  unsigned long doorOpenings;
+  unsigned long lines;
+};
+
+struct Client {
+  int fd; // -1 when free
+  char request[REQUEST_BUFFER];
+  size_t received;
+  char *response;
+  size_t size;
+  size_t sent;
+};
+
+struct Options {
+  int ptys = 0;
+  long baud = 115200;
+  int listenPort = 9464;
+  double heaterWatts = 2000;
+};
+
+// A piece of a line, parsed in place.
+struct Slice {
+  const char *data;
+  size_t length;
+
+  bool is(const char *text) const { return strlen(text) == length && !memcmp(text, data, length); }
+};
+
+// Metrics text, grown as needed and kept between scrapes.
+struct Text {
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+Options options;
+Controller controllers[MAX_CONTROLLERS];
+int controllerCount = 0;
+Client clients[MAX_CLIENTS];
+int epollFd = -1;
+int listenFd = -1;
+Text text;
+
+// Aggregation.
+
+template <int N>
+void observe(Histogram &h, const double (&bounds)[N], double value) {
+  static_assert(N < MAX_BUCKETS, "Too many bounds for MAX_BUCKETS");
+  int i = 0;
+  while (i < N && value > bounds[i]) {
+    i++;
+  }
+  h.buckets[i]++;
+  h.sum += value;
+  h.count++;
+}
+
+int phaseIndex(int state) {
+  const char *phase = state >= 0 && state < STATE_COUNT ? STATE_PHASES[state] : nullptr;
+  for (int i = 0; phase && i < PHASE_COUNT; i++) {
+    if (!strcmp(phase, PHASES[i])) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// A controller restarted, what was going on is lost.
+void restartTimeline(Controller &c) {
+  c.state = -1;
+  c.phase = -1;
+  c.heaterOn = false;
+}
+
+void stateChanged(Controller &c, unsigned long millis, int state) {
+  int phase = phaseIndex(state);
+  if (phase != c.phase) {
+    if (c.phase >= 0) {
+      observe(c.phases[c.phase], PHASE_BOUNDS, (millis - c.phaseSince) / 1000.0);
+    }
+    c.phase = phase;
+    c.phaseSince = millis;
+  }
+  if (state == STATE_DONE && c.state != STATE_DONE) {
+    c.programs++;
+  }
+  if (state == STATE_LEAK && c.state != STATE_LEAK) {
+    c.leaks++;
+  }
+  c.state = state;
+}
+
+void outputsChanged(Controller &c, unsigned long millis, int outputs) {
+  bool heaterOn = outputs >> HEATER_OUTPUT & 1;
+  if (c.heaterOn && !heaterOn) {
+    c.heaterJoules += (millis - c.heaterSince) / 1000.0 * options.heaterWatts;
+  }
+  if (heaterOn && !c.heaterOn) {
+    c.heaterSince = millis;
+  }
+  c.heaterOn = heaterOn;
+}
+
+// Next space separated word of the line, the rest of it for the last one.
+Slice word(Slice &rest, bool last) {
+  while (rest.length && *rest.data == ' ') {
+    rest.data++;
+    rest.length--;
+  }
+  Slice w = rest;
+  if (!last) {
+    const char *space = (const char *)memchr(rest.data, ' ', rest.length);
+    w.length = space ? space - rest.data : rest.length;
+  }
+  rest.data += w.length;
+  rest.length -= w.length;
+  return w;
+}
+
+// "T <millis> <name> <value>", parsed where it was read, the line ends in a NUL in place of its newline.
+void parseLine(Controller &c, char *data, size_t length) {
+  data[length] = 0;
+  Slice rest = { data, length };
+  Slice tag = word(rest, false);
+  Slice millisWord = word(rest, false);
+  Slice name = word(rest, false);
+  Slice value = word(rest, true);
+  if (!tag.is("T") || !name.length || !value.length) {
+    return;
+  }
+  unsigned long millis = strtoul(millisWord.data, nullptr, 10);
+  if (millis < c.lastMillis) {
+    restartTimeline(c);
+  }
+  c.lastMillis = millis;
+  c.lines++;
+  double number = strtod(value.data, nullptr);
+  if (name.is("state")) {
+    stateChanged(c, millis, (int)number);
+  } else if (name.is("outputs")) {
+    outputsChanged(c, millis, (int)number);
+  } else if (name.is("heat_rate")) {
+    observe(c.heatingRate, RATE_BOUNDS, number);
+  } else if (name.is("fault")) {
+    int code = (int)number;
+    c.faults[code >= 0 && code < MAX_FAULT ? code : MAX_FAULT]++;
+  } else if (name.is("door") && value.is("open")) {
+    c.doorOpenings++;
+  }
+}
+
+void readController(Controller &c) {
+  while (true) {
+    ssize_t n = read(c.fd, c.line + c.used, LINE_BUFFER - 1 - c.used); // room for the NUL
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n == 0 || errno != EAGAIN) {
+        note("controller %s: %s, no longer read", c.name, n == 0 ? "closed" : strerror(errno));
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c.fd, nullptr);
+      }
+      return;
+    }
+    c.used += n;
+    size_t start = 0;
+    char *newline;
+    while ((newline = (char *)memchr(c.line + start, '\n', c.used - start)) != nullptr) {
+      size_t end = newline - c.line;
+      if (!c.skipping) {
+        parseLine(c, c.line + start, end > start && c.line[end - 1] == '\r' ? end - start - 1 : end - start);
+      }
+      c.skipping = false;
+      start = end + 1;
+    }
+    if (start == 0 && c.used == LINE_BUFFER - 1) {
+      c.skipping = true; // no newline in a full buffer
+      c.used = 0;
+    } else if (start > 0) {
+      memmove(c.line, c.line + start, c.used - start);
+      c.used -= start;
+    }
+  }
+}
+
+// Scrapes.
+
+void append(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+void append(const char *format, ...) {
+  while (true) {
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(text.data + text.length, text.capacity - text.length, format, args);
+    va_end(args);
+    if (n >= 0 && text.length + n < text.capacity) {
+      text.length += n;
+      return;
+    }
+    text.capacity = text.capacity ? text.capacity * 2 : 64 * 1024;
+    text.data = (char *)realloc(text.data, text.capacity);
+    if (!text.data) {
+      perror("realloc");
+      exit(2);
+    }
+  }
+}
+
+void header(const char *name, const char *type, const char *help) {
+  append("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+template <int N>
+void histogram(const char *name, const char *labels, const Histogram &h, const double (&bounds)[N]) {
+  unsigned long cumulative = 0;
+  for (int i = 0; i < N; i++) {
+    cumulative += h.buckets[i];
+    append("%s_bucket{%s,le=\"%g\"} %lu\n", name, labels, bounds[i], cumulative);
+  }
+  append("%s_bucket{%s,le=\"+Inf\"} %lu\n", name, labels, h.count);
+  append("%s_sum{%s} %g\n%s_count{%s} %lu\n", name, labels, h.sum, name, labels, h.count);
+}
+
+void render() {
+  text.length = 0;
+  char labels[128];
+  header("dishwasher_phase_seconds", "histogram", "Program phase durations.");
+  for (int i = 0; i < controllerCount; i++) {
+    for (int p = 0; p < PHASE_COUNT; p++) {
+      snprintf(labels, sizeof(labels), "controller=\"%s\",phase=\"%s\"", controllers[i].name, PHASES[p]);
+      histogram("dishwasher_phase_seconds", labels, controllers[i].phases[p], PHASE_BOUNDS);
+    }
+  }
+  header("dishwasher_heating_rate", "histogram", "Learned heating rate, centigrades per minute.");
+  for (int i = 0; i < controllerCount; i++) {
+    snprintf(labels, sizeof(labels), "controller=\"%s\"", controllers[i].name);
+    histogram("dishwasher_heating_rate", labels, controllers[i].heatingRate, RATE_BOUNDS);
+  }
+  header("dishwasher_heater_energy_joules_total", "counter", "Heater energy, on time times the heater power.");
+  for (int i = 0; i < controllerCount; i++) {
+    append("dishwasher_heater_energy_joules_total{controller=\"%s\"} %.0f\n", controllers[i].name,
+           controllers[i].heaterJoules);
+  }
+  header("dishwasher_programs_total", "counter", "Programs done.");
+  for (int i = 0; i < controllerCount; i++) {
+    append("dishwasher_programs_total{controller=\"%s\"} %lu\n", controllers[i].name, controllers[i].programs);
+  }
+  header("dishwasher_faults_total", "counter", "Faults by beeped issue code.");
+  for (int i = 0; i < controllerCount; i++) {
+    for (int code = 0; code <= MAX_FAULT; code++) {
+      if (controllers[i].faults[code]) {
+        append("dishwasher_faults_total{controller=\"%s\",code=\"%s%d\"} %lu\n", controllers[i].name,
+               code == MAX_FAULT ? ">=" : "", code, controllers[i].faults[code]);
+      }
+    }
+  }
+  header("dishwasher_leaks_total", "counter", "Leak sensor alarms.");
+  for (int i = 0; i < controllerCount; i++) {
+    append("dishwasher_leaks_total{controller=\"%s\"} %lu\n", controllers[i].name, controllers[i].leaks);
+  }
+  header("dishwasher_door_openings_total", "counter", "Door openings.");
+  for (int i = 0; i < controllerCount; i++) {
+    append("dishwasher_door_openings_total{controller=\"%s\"} %lu\n", controllers[i].name,
+           controllers[i].doorOpenings);
+  }
+  header("dishwasher_state", "gauge", "State number as in status.h, -1 before the first report.");
+  for (int i = 0; i < controllerCount; i++) {
+    append("dishwasher_state{controller=\"%s\"} %d\n", controllers[i].name, controllers[i].state);
+  }
+  header("dishwasher_telemetry_lines_total", "counter", "Telemetry lines read.");
+  for (int i = 0; i < controllerCount; i++) {
+    append("dishwasher_telemetry_lines_total{controller=\"%s\"} %lu\n", controllers[i].name, controllers[i].lines);
+  }
+}
+
+void closeClient(Client &client) {
+  close(client.fd);
+  free(client.response);
+  client.fd = -1;
+  client.response = nullptr;
+}
+
+// Write what the socket takes, the rest goes on the next EPOLLOUT.
+void sendResponse(Client &client, int index) {
+  while (client.sent < client.size) {
+    ssize_t n = write(client.fd, client.response + client.sent, client.size - client.sent);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      epoll_event event;
+      event.events = EPOLLOUT;
+      event.data.u32 = CLIENT_TAG + index;
+      epoll_ctl(epollFd, EPOLL_CTL_MOD, client.fd, &event);
+      return;
+    }
+    if (n <= 0) {
+      break;
+    }
+    client.sent += n;
+  }
+  closeClient(client);
+}
+
+void respond(Client &client, int index) {
+  bool metrics = !strncmp(client.request, "GET /metrics ", 13) || !strncmp(client.request, "GET / ", 6);
+  if (metrics) {
+    render();
+  }
+  char head[160];
+  int headLength = snprintf(head, sizeof(head),
+                            "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+                            "Connection: close\r\n\r\n",
+                            metrics ? "200 OK" : "404 Not Found", metrics ? text.length : 0);
+  client.size = headLength + (metrics ? text.length : 0);
+  client.response = (char *)malloc(client.size);
+  memcpy(client.response, head, headLength);
+  if (metrics) {
+    memcpy(client.response + headLength, text.data, text.length);
+  }
+  client.sent = 0;
+  sendResponse(client, index);
+}
+
+void clientEvent(int index, uint32_t events) {
+  Client &client = clients[index];
+  if (client.response) {
+    sendResponse(client, index);
+    return;
+  }
+  ssize_t n = read(client.fd, client.request + client.received, REQUEST_BUFFER - 1 - client.received);
+  if (n < 0 && errno == EAGAIN) {
+    return;
+  }
+  if (n <= 0 || (events & EPOLLERR)) {
+    closeClient(client);
+    return;
+  }
+  client.received += n;
+  client.request[client.received] = 0;
+  if (strstr(client.request, "\r\n\r\n") || strstr(client.request, "\n\n")) {
+    respond(client, index);
+  } else if (client.received == REQUEST_BUFFER - 1) {
+    closeClient(client);
+  }
+}
+
+void acceptClient() {
+  int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK);
+  if (fd < 0) {
+    return;
+  }
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (clients[i].fd < 0) {
+      clients[i].fd = fd;
+      clients[i].received = 0;
+      watch(epollFd, fd, EPOLLIN, CLIENT_TAG + i);
+      return;
+    }
+  }
+  close(fd); // busy, the scraper retries
+}
+
+void startListening() {
+  listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  int yes = 1;
+  setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(options.listenPort);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(listenFd, (sockaddr *)&address, sizeof(address)) != 0 || listen(listenFd, MAX_CLIENTS) != 0) {
+    perror("listen");
+    exit(2);
+  }
+  watch(epollFd, listenFd, EPOLLIN, LISTEN_TAG);
+}
+
+void usage(const char *name) {
+  fprintf(stderr, "usage: %s (--port NAME=DEVICE ... [--baud BAUD] | --pty COUNT) [--listen PORT] "
+          "[--heater-watts WATTS]\n", name);
+  exit(2);
+}
+
+void parseOptions(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--port") && i + 1 < argc && controllerCount < MAX_CONTROLLERS) {
+      char *name = argv[++i];
+      char *device = strchr(name, '=');
+      if (!device || device == name) {
+        usage(argv[0]);
+      }
+      *device++ = 0;
+      controllers[controllerCount].name = name;
+      controllers[controllerCount++].device = device;
+    } else if (!strcmp(argv[i], "--pty") && i + 1 < argc) {
+      options.ptys = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--baud") && i + 1 < argc) {
+      options.baud = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "--listen") && i + 1 < argc) {
+      options.listenPort = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--heater-watts") && i + 1 < argc) {
+      options.heaterWatts = atof(argv[++i]);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if ((controllerCount > 0) == (options.ptys > 0) || options.ptys > MAX_CONTROLLERS || options.listenPort <= 0) {
+    usage(argv[0]);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+  epollFd = epoll_create1(0);
+  if (options.ptys) {
+    openPtys(controllers, options.ptys);
+    controllerCount = options.ptys;
+  } else {
+    openPorts(controllers, controllerCount, options.baud);
+  }
+  for (int i = 0; i < controllerCount; i++) {
+    restartTimeline(controllers[i]);
+    watch(epollFd, controllers[i].fd, EPOLLIN, i);
+  }
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    clients[i].fd = -1;
+  }
+  startListening();
+  note("metrics for %d controllers on http://127.0.0.1:%d/metrics", controllerCount, options.listenPort);
+  epoll_event events[MAX_CONTROLLERS + MAX_CLIENTS + 1];
+  while (true) {
+    int count = epoll_wait(epollFd, events, MAX_CONTROLLERS + MAX_CLIENTS + 1, -1);
+    for (int i = 0; i < count; i++) {
+      uint32_t tag = events[i].data.u32;
+      if (tag == LISTEN_TAG) {
+        acceptClient();
+      } else if (tag >= CLIENT_TAG) {
+        clientEvent(tag - CLIENT_TAG, events[i].events);
+      } else {
+        readController(controllers[tag]);
+      }
+    }
+  }
+}
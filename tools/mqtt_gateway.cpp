@@ -0,0 +1,606 @@
+// Host gateway between controller telemetry ports and a local MQTT broker, see include/telemetry.h.
+//
+//   mqtt_gateway (--port NAME=DEVICE ... [--baud BAUD] | --pty COUNT) [--broker HOST[:PORT]] [--prefix TOPIC]
+//                [--batch MS]
+//
+// Every telemetry line "T <millis> <name> <value>" from the controller NAME is published to PREFIX/NAME/<name>
+// with the value as payload, QoS 0. PREFIX is "dishwasher" and the broker 127.0.0.1:1883 unless told otherwise.
+// Messages published to PREFIX/NAME/command go back to that controller as a "C <payload>" line, "start rinse" say.
+// A telemetry line named command is never published, it would loop back down.
+//
+// One thread and one epoll loop serve every port and the broker. Lines are parsed where they were read into,
+// the publish packets are built straight into the outgoing buffer and written every --batch milliseconds (50),
+// or sooner once the buffer fills up. While the broker is away lines are dropped, the connection is retried
+// every few seconds.
+//
+// With --pty there are no serial ports: controllers 1 to COUNT get a pseudo terminal each, printed at startup.
+// That's how simulated controllers are tested:
+//
+//   dishwasher --telemetry /dev/pts/N --press -1 --speed 20
+//   mosquitto_pub -t dishwasher/1/command -m "start regular"
+//
+// Build with: g++ -std=gnu++11 -O2 -Wall tools/mqtt_gateway.cpp -o mqtt_gateway
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include "serial_util.h"
+
+namespace {
+
+const int MAX_CONTROLLERS = 64;
+const size_t LINE_BUFFER = 512;       // per controller, longer lines are garbage
+const size_t OUT_BUFFER = 64 * 1024;  // publishes waiting for the next batch
+const size_t IN_BUFFER = 4096;        // from the broker, larger packets are skipped
+const int KEEP_ALIVE = 60;            // seconds, a ping goes out every half of it
+const int RECONNECT_DELAY = 3;        // seconds
+const unsigned short SUBSCRIBE_ID = 1;
+
+// epoll tags, controllers are tagged with their index.
+const uint32_t BROKER_TAG = 0xFFFF0000;
+const uint32_t TIMER_TAG = 0xFFFF0001;
+
+struct Controller {
+  const char *name;
+  const char *device;
+  int fd;
+  int slaveFd; // --pty keeps its own end open, the master would hang up whenever a controller goes away
+  char line[LINE_BUFFER];
+  size_t used;
+  bool skipping; // in a line too long for the buffer
+  unsigned long published;
+  unsigned long dropped;
+};
+
+enum BrokerState { BROKER_DOWN, BROKER_CONNECTING, BROKER_HANDSHAKE, BROKER_UP };
+
+struct Options {
+  int ptys = 0;
+  long baud = 115200;
+  const char *host = "127.0.0.1";
+  const char *port = "1883";
+  const char *prefix = "dishwasher";
+  long batchMs = 50;
+};
+
+// A piece of a line, parsed in place.
+struct Slice {
+  const char *data;
+  size_t length;
+};
+
+Options options;
+Controller controllers[MAX_CONTROLLERS];
+int controllerCount = 0;
+int epollFd = -1;
+int timerFd = -1;
+
+int brokerFd = -1;
+BrokerState brokerState = BROKER_DOWN;
+bool brokerWaitsOutput = false; // EPOLLOUT registered
+double brokerRetry = 0;          // when to try connecting again
+double lastSent = 0;
+unsigned char out[OUT_BUFFER];
+size_t outUsed = 0;
+size_t outSent = 0;
+unsigned char in[IN_BUFFER];
+size_t inUsed = 0;
+size_t inSkip = 0; // bytes of an oversized packet still to throw away
+
+// Broker connection.
+
+void updateBrokerEvents() {
+  bool wantsOutput = brokerState == BROKER_CONNECTING || outSent < outUsed;
+  if (wantsOutput == brokerWaitsOutput) {
+    return;
+  }
+  epoll_event event;
+  event.events = EPOLLIN | (wantsOutput ? (uint32_t)EPOLLOUT : 0);
+  event.data.u32 = BROKER_TAG;
+  epoll_ctl(epollFd, EPOLL_CTL_MOD, brokerFd, &event);
+  brokerWaitsOutput = wantsOutput;
+}
+
+void brokerDown(const char *why) {
+  if (brokerState != BROKER_DOWN) {
+    note("broker %s, publishing again once it is back", why);
+    close(brokerFd);
+  }
+  brokerFd = -1;
+  brokerState = BROKER_DOWN;
+  brokerWaitsOutput = false;
+  brokerRetry = seconds() + RECONNECT_DELAY;
+  outUsed = outSent = 0;
+  inUsed = inSkip = 0;
+}
+
+// Write out whatever is waiting, as much as the socket takes.
+void flush() {
+  if (brokerState == BROKER_DOWN || brokerState == BROKER_CONNECTING) {
+    return;
+  }
+  while (outSent < outUsed) {
+    ssize_t n = write(brokerFd, out + outSent, outUsed - outSent);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      break;
+    }
+    if (n <= 0) {
+      brokerDown("lost");
+      return;
+    }
+    outSent += n;
+    lastSent = seconds();
+  }
+  memmove(out, out + outSent, outUsed - outSent); // the socket's share of the rest, if any
+  outUsed -= outSent;
+  outSent = 0;
+  updateBrokerEvents();
+}
+
+// Room for a packet of the given size in the outgoing buffer, flushing early if need be.
+bool reserve(size_t size) {
+  if (outUsed + size > OUT_BUFFER) {
+    flush();
+  }
+  return brokerState != BROKER_DOWN && outUsed + size <= OUT_BUFFER;
+}
+
+void put(const void *data, size_t length) {
+  memcpy(out + outUsed, data, length);
+  outUsed += length;
+}
+
+void putByte(unsigned char b) {
+  out[outUsed++] = b;
+}
+
+void putWord(unsigned short w) {
+  putByte(w >> 8);
+  putByte(w & 0xFF);
+}
+
+// MQTT remaining length, 7 bits a byte.
+size_t lengthSize(size_t length) {
+  return length < 128 ? 1 : length < 16384 ? 2 : 3;
+}
+
+void putHeader(unsigned char type, size_t length) {
+  putByte(type);
+  do {
+    unsigned char b = length & 0x7F;
+    length >>= 7;
+    putByte(b | (length ? 0x80 : 0));
+  } while (length);
+}
+
+void putString(const char *text) {
+  size_t length = strlen(text);
+  putWord(length);
+  put(text, length);
+}
+
+void sendConnect() {
+  char clientId[32];
+  snprintf(clientId, sizeof(clientId), "dishwasher-gateway-%d", (int)getpid());
+  size_t length = 10 + 2 + strlen(clientId);
+  reserve(1 + lengthSize(length) + length);
+  putHeader(0x10, length);
+  putString("MQTT");
+  putByte(4);    // protocol level, 3.1.1
+  putByte(0x02); // clean session
+  putWord(KEEP_ALIVE);
+  putString(clientId);
+  flush();
+}
+
+void sendSubscribe() {
+  char topic[128];
+  snprintf(topic, sizeof(topic), "%s/+/command", options.prefix);
+  size_t length = 2 + 2 + strlen(topic) + 1;
+  reserve(1 + lengthSize(length) + length);
+  putHeader(0x82, length);
+  putWord(SUBSCRIBE_ID);
+  putString(topic);
+  putByte(0); // QoS 0
+  flush();
+}
+
+void sendPing() {
+  if (reserve(2)) {
+    putHeader(0xC0, 0);
+    flush();
+  }
+}
+
+void connectBroker() {
+  addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *address = nullptr;
+  brokerRetry = seconds() + RECONNECT_DELAY;
+  if (getaddrinfo(options.host, options.port, &hints, &address) != 0) {
+    return;
+  }
+  brokerFd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (brokerFd < 0) {
+    freeaddrinfo(address);
+    return;
+  }
+  int result = connect(brokerFd, address->ai_addr, address->ai_addrlen);
+  freeaddrinfo(address);
+  if (result != 0 && errno != EINPROGRESS) {
+    close(brokerFd);
+    brokerFd = -1;
+    return;
+  }
+  brokerState = BROKER_CONNECTING;
+  brokerWaitsOutput = true;
+  watch(epollFd, brokerFd, EPOLLIN | EPOLLOUT, BROKER_TAG);
+}
+
+// Telemetry.
+
+Controller *findController(const char *name, size_t length) {
+  for (int i = 0; i < controllerCount; i++) {
+    if (strlen(controllers[i].name) == length && !memcmp(controllers[i].name, name, length)) {
+      return &controllers[i];
+    }
+  }
+  return nullptr;
+}
+
+// Next space separated word of the line, the rest of it for the last one.
+Slice word(Slice &rest, bool last) {
+  while (rest.length && *rest.data == ' ') {
+    rest.data++;
+    rest.length--;
+  }
+  Slice w = rest;
+  if (!last) {
+    const char *space = (const char *)memchr(rest.data, ' ', rest.length);
+    w.length = space ? space - rest.data : rest.length;
+  }
+  rest.data += w.length;
+  rest.length -= w.length;
+  return w;
+}
+
+void publish(Controller &c, Slice name, Slice value) {
+  size_t prefixLength = strlen(options.prefix);
+  size_t nameLength = strlen(c.name);
+  size_t topicLength = prefixLength + 1 + nameLength + 1 + name.length;
+  size_t length = 2 + topicLength + value.length;
+  if (!reserve(1 + lengthSize(length) + length) || brokerState != BROKER_UP) {
+    c.dropped++;
+    return;
+  }
+  putHeader(0x30, length);
+  putWord(topicLength);
+  put(options.prefix, prefixLength);
+  putByte('/');
+  put(c.name, nameLength);
+  putByte('/');
+  put(name.data, name.length);
+  put(value.data, value.length);
+  c.published++;
+}
+
+// "T <millis> <name> <value>", anything else the controller prints is not telemetry.
+void parseLine(Controller &c, const char *data, size_t length) {
+  if (length && data[length - 1] == '\r') {
+    length--;
+  }
+  Slice rest = { data, length };
+  Slice tag = word(rest, false);
+  word(rest, false); // millis, the broker stamps messages itself
+  Slice name = word(rest, false);
+  Slice value = word(rest, true);
+  if (tag.length != 1 || *tag.data != 'T' || !name.length || !value.length) {
+    return;
+  }
+  // Published there it would come straight back down to the controller as a command.
+  if (name.length == 7 && !memcmp(name.data, "command", 7)) {
+    return;
+  }
+  publish(c, name, value);
+}
+
+void readController(Controller &c) {
+  while (true) {
+    ssize_t n = read(c.fd, c.line + c.used, LINE_BUFFER - c.used);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n == 0 || errno != EAGAIN) {
+        note("controller %s: %s, no longer read", c.name, n == 0 ? "closed" : strerror(errno));
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, c.fd, nullptr);
+      }
+      return;
+    }
+    c.used += n;
+    size_t start = 0;
+    const char *newline;
+    while ((newline = (const char *)memchr(c.line + start, '\n', c.used - start)) != nullptr) {
+      size_t end = newline - c.line;
+      if (!c.skipping) {
+        parseLine(c, c.line + start, end - start);
+      }
+      c.skipping = false;
+      start = end + 1;
+    }
+    if (start == 0 && c.used == LINE_BUFFER) {
+      c.skipping = true; // no newline in a full buffer
+      c.used = 0;
+    } else if (start > 0) {
+      memmove(c.line, c.line + start, c.used - start); // only the partial line left
+      c.used -= start;
+    }
+  }
+}
+
+// Commands.
+
+// PREFIX/NAME/command goes down to NAME as "C <payload>".
+void relayCommand(const unsigned char *topic, size_t topicLength, const unsigned char *payload, size_t length) {
+  size_t prefixLength = strlen(options.prefix);
+  const char *suffix = "/command";
+  size_t suffixLength = strlen(suffix);
+  if (topicLength <= prefixLength + 1 + suffixLength || memcmp(topic, options.prefix, prefixLength) ||
+      topic[prefixLength] != '/' || memcmp(topic + topicLength - suffixLength, suffix, suffixLength)) {
+    return;
+  }
+  const char *name = (const char *)topic + prefixLength + 1;
+  size_t nameLength = topicLength - prefixLength - 1 - suffixLength;
+  Controller *c = findController(name, nameLength);
+  if (!c || memchr(payload, '\n', length)) {
+    return;
+  }
+  iovec parts[3] = { { (void *)"C ", 2 }, { (void *)payload, length }, { (void *)"\n", 1 } };
+  if (writev(c->fd, parts, 3) != (ssize_t)(length + 3)) {
+    note("controller %s: command %.*s not sent", c->name, (int)length, (const char *)payload);
+    return;
+  }
+  note("controller %s: %.*s", c->name, (int)length, (const char *)payload);
+}
+
+void handlePacket(const unsigned char *packet, size_t headerLength, size_t length) {
+  const unsigned char *body = packet + headerLength;
+  switch (packet[0] >> 4) {
+    case 2: // CONNACK
+      if (length < 2 || body[1] != 0) {
+        brokerDown("refused the connection");
+        return;
+      }
+      brokerState = BROKER_UP;
+      note("broker up at %s:%s", options.host, options.port);
+      for (int i = 0; i < controllerCount; i++) {
+        if (controllers[i].dropped) {
+          note("controller %s: %lu lines dropped meanwhile", controllers[i].name, controllers[i].dropped);
+          controllers[i].dropped = 0;
+        }
+      }
+      sendSubscribe();
+      break;
+    case 3: { // PUBLISH
+      if (length < 2) {
+        return;
+      }
+      size_t topicLength = body[0] << 8 | body[1];
+      size_t id = (packet[0] >> 1) & 3 ? 2 : 0; // only QoS 0 was asked for, skip the id anyway
+      if (2 + topicLength + id > length) {
+        return;
+      }
+      size_t payloadStart = 2 + topicLength + id;
+      relayCommand(body + 2, topicLength, body + payloadStart, length - payloadStart);
+      break;
+    }
+  }
+}
+
+// Packets from the broker, handled where they sit in the buffer.
+void readBroker() {
+  while (true) {
+    ssize_t n = read(brokerFd, in + inUsed, IN_BUFFER - inUsed);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && errno == EAGAIN) {
+      return;
+    }
+    if (n <= 0) {
+      brokerDown("lost");
+      return;
+    }
+    size_t skipped = (size_t)n < inSkip ? n : inSkip;
+    inSkip -= skipped;
+    memmove(in + inUsed, in + inUsed + skipped, n - skipped);
+    inUsed += n - skipped;
+    size_t start = 0;
+    while (inUsed - start >= 2) {
+      size_t length = 0;
+      size_t header = 1;
+      unsigned shift = 0;
+      bool complete = false;
+      while (header < inUsed - start && header <= 4) {
+        unsigned char b = in[start + header++];
+        length |= (size_t)(b & 0x7F) << shift;
+        shift += 7;
+        if (!(b & 0x80)) {
+          complete = true;
+          break;
+        }
+      }
+      if (!complete) {
+        break;
+      }
+      if (header + length > IN_BUFFER) {
+        inSkip = header + length - (inUsed - start); // too big for us, a command never is
+        start = inUsed;
+        break;
+      }
+      if (inUsed - start < header + length) {
+        break;
+      }
+      handlePacket(in + start, header, length);
+      if (brokerState == BROKER_DOWN) {
+        return;
+      }
+      start += header + length;
+    }
+    memmove(in, in + start, inUsed - start);
+    inUsed -= start;
+  }
+}
+
+void brokerEvent(uint32_t events) {
+  if (brokerState == BROKER_DOWN) {
+    return; // closed earlier in this round of events
+  }
+  if (brokerState == BROKER_CONNECTING) {
+    int error = 0;
+    socklen_t size = sizeof(error);
+    getsockopt(brokerFd, SOL_SOCKET, SO_ERROR, &error, &size);
+    if (error || (events & (EPOLLERR | EPOLLHUP))) {
+      close(brokerFd);
+      brokerFd = -1;
+      brokerState = BROKER_DOWN;
+      brokerWaitsOutput = false;
+      return;
+    }
+    if (!(events & EPOLLOUT)) {
+      return;
+    }
+    brokerState = BROKER_HANDSHAKE;
+    sendConnect();
+    return;
+  }
+  if (events & EPOLLIN) {
+    readBroker();
+  }
+  if (brokerState != BROKER_DOWN && (events & EPOLLOUT)) {
+    flush();
+  }
+  if (brokerState != BROKER_DOWN && (events & (EPOLLERR | EPOLLHUP))) {
+    brokerDown("lost");
+  }
+}
+
+// Every batch period: write the batch, keep the connection alive or bring it back.
+void tick() {
+  uint64_t expirations;
+  if (read(timerFd, &expirations, sizeof(expirations)) < 0) {
+    // nothing to read, spurious wake up
+  }
+  double now = seconds();
+  if (brokerState == BROKER_DOWN && now >= brokerRetry) {
+    connectBroker();
+  }
+  if (brokerState == BROKER_UP && outUsed == 0 && now - lastSent > KEEP_ALIVE / 2) {
+    sendPing();
+  }
+  flush();
+}
+
+void startTimer() {
+  timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  itimerspec period;
+  period.it_interval.tv_sec = options.batchMs / 1000;
+  period.it_interval.tv_nsec = options.batchMs % 1000 * 1000000;
+  period.it_value = period.it_interval;
+  if (timerFd < 0 || timerfd_settime(timerFd, 0, &period, nullptr) != 0) {
+    perror("timerfd");
+    exit(2);
+  }
+  watch(epollFd, timerFd, EPOLLIN, TIMER_TAG);
+}
+
+void usage(const char *name) {
+  fprintf(stderr, "usage: %s (--port NAME=DEVICE ... [--baud BAUD] | --pty COUNT) [--broker HOST[:PORT]] "
+          "[--prefix TOPIC] [--batch MS]\n", name);
+  exit(2);
+}
+
+void parseOptions(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--port") && i + 1 < argc && controllerCount < MAX_CONTROLLERS) {
+      char *name = argv[++i];
+      char *device = strchr(name, '=');
+      if (!device || device == name) {
+        usage(argv[0]);
+      }
+      *device++ = 0;
+      controllers[controllerCount].name = name;
+      controllers[controllerCount++].device = device;
+    } else if (!strcmp(argv[i], "--pty") && i + 1 < argc) {
+      options.ptys = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--baud") && i + 1 < argc) {
+      options.baud = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "--broker") && i + 1 < argc) {
+      char *host = argv[++i];
+      char *port = strrchr(host, ':');
+      if (port) {
+        *port++ = 0;
+        options.port = port;
+      }
+      options.host = host;
+    } else if (!strcmp(argv[i], "--prefix") && i + 1 < argc) {
+      options.prefix = argv[++i];
+    } else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+      options.batchMs = atol(argv[++i]);
+    } else {
+      usage(argv[0]);
+    }
+  }
+  if ((controllerCount > 0) == (options.ptys > 0) || options.ptys > MAX_CONTROLLERS || options.batchMs < 1 ||
+      strlen(options.prefix) > 64) {
+    usage(argv[0]);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+  epollFd = epoll_create1(0);
+  if (options.ptys) {
+    openPtys(controllers, options.ptys);
+    controllerCount = options.ptys;
+  } else {
+    openPorts(controllers, controllerCount, options.baud);
+  }
+  for (int i = 0; i < controllerCount; i++) {
+    watch(epollFd, controllers[i].fd, EPOLLIN, i);
+  }
+  startTimer();
+  note("gateway for %d controllers, broker %s:%s, topics %s/NAME/...", controllerCount, options.host, options.port,
+       options.prefix);
+  connectBroker();
+  epoll_event events[MAX_CONTROLLERS + 2];
+  while (true) {
+    int count = epoll_wait(epollFd, events, MAX_CONTROLLERS + 2, -1);
+    for (int i = 0; i < count; i++) {
+      uint32_t tag = events[i].data.u32;
+      if (tag == BROKER_TAG) {
+        brokerEvent(events[i].events);
+      } else if (tag == TIMER_TAG) {
+        tick();
+      } else {
+        readController(controllers[tag]);
+      }
+    }
+  }
+}
@@ -0,0 +1,338 @@
+// Host coordinator for the heater power bus, see include/powerbus.h.
+//
+//   power_coordinator --cap WATTS --nodes COUNT (--port DEVICE [--baud BAUD] | --pty) [--max-wait SECONDS]
+//                     [--modbus DEVICE]
+//
+// Polls controllers 1 to COUNT in turn and hands out heater power so the heaters on at any time stay under the cap.
+// Grants are never taken back, so the scheduling is about who goes next: among the controllers waiting, the one
+// expected to finish heating first goes first (shortest job first keeps the most machines moving), anyone waiting
+// longer than --max-wait (10 minutes) jumps the queue, and a smaller heater fills in power a bigger one can't use.
+// Grants are only renewed while a controller replies, one silent for OFFLINE_RELEASE has let its grant lapse by
+// then (see POWER_LEASE_SECONDS) and its power goes to someone else.
+//
+// With --pty there is no serial port: every controller gets a pseudo terminal, printed at startup, and the frames
+// go to all of them as they would on a shared bus. That's how simulated controllers are tested together:
+//
+//   dishwasher --bus /dev/pts/N --address 2 --speed 20
+//
+// Mind that --max-wait is wall clock time, divide it by the speed of the simulated controllers.
+//
+// The coordinator must be the only master on the bus, a building management system polling the Modbus registers
+// as well would talk over the power polls. It goes through --modbus instead, a serial port (at --baud) or pty
+// for a pseudo terminal printed at startup: its requests are passed on to the bus between two polls and the
+// replies passed back, a controller that doesn't reply gets no reply through either.
+//
+// Build with: g++ -std=gnu++11 -O2 -Wall -Iinclude tools/power_coordinator.cpp -o power_coordinator
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "powerbus.h"
+#include "serial_util.h"
+
+namespace {
+
+const int REPLY_TIMEOUT_MS = 100;
+const int POLL_GAP_MS = 20;       // between two polls, lets the bus settle
+const int MODBUS_GAP_MS = 5;      // silence ending a request of unknown length from --modbus
+constexpr double GRANT_RENEWAL = 10;   // seconds since the last reply a grant is still renewed for
+constexpr double OFFLINE_RELEASE = 60; // seconds without replies before a holder's power is given back
+static_assert(GRANT_RENEWAL + POWER_LEASE_SECONDS < OFFLINE_RELEASE,
+              "A silent holder's lease must run out before its power is given back");
+const int MAX_NODES = 32;
+const int MAX_PORTS = MAX_NODES;
+
+struct Node {
+  unsigned char address;
+  bool seen;
+  PowerStatus status;
+  bool granted;       // power counted as in use by this node
+  double lastSeen;
+  double waitingSince; // 0 while not waiting
+  bool tooBig;         // asked for more than the cap, reported once
+};
+
+struct Options {
+  long cap = 0;
+  int nodes = 0;
+  const char *port = nullptr;
+  long baud = 19200;
+  bool pty = false;
+  double maxWait = 600; // seconds waiting before going first whatever the expected heating time
+  const char *modbus = nullptr; // device of the building management system, pty for a pseudo terminal
+};
+
+Options options;
+Node nodes[MAX_NODES];
+int ports[MAX_PORTS];
+int portCount = 0;
+int modbusFd = -1;
+unsigned char request[256]; // Modbus request from --modbus being received
+int requestLength = 0;
+double requestTime = 0;     // of its last byte
+
+void openNodePtys() {
+  for (int i = 0; i < options.nodes; i++) {
+    int fd = openPty();
+    makeRaw(fd, 0);
+    ports[portCount++] = fd;
+    printf("node %d: %s\n", i + 1, ptsname(fd));
+  }
+  fflush(stdout);
+}
+
+// Writes go to every port, like frames on a shared bus. A pty nobody opened yet just drops them.
+void send(const unsigned char *frame, unsigned char length) {
+  for (int i = 0; i < portCount; i++) {
+    if (write(ports[i], frame, length) < 0) {
+      // nobody listening on this one
+    }
+  }
+}
+
+// Throw away anything left over from earlier frames.
+void discardInput() {
+  unsigned char buffer[64];
+  for (int i = 0; i < portCount; i++) {
+    while (read(ports[i], buffer, sizeof(buffer)) > 0) {
+    }
+  }
+}
+
+// Wait up to REPLY_TIMEOUT_MS for a frame from address with a valid CRC, returns its length, 0 for none.
+int receiveReply(unsigned char address, unsigned char *frame, int size) {
+  int length = 0;
+  double deadline = seconds() + REPLY_TIMEOUT_MS / 1000.0;
+  pollfd fds[MAX_PORTS];
+  for (int i = 0; i < portCount; i++) {
+    fds[i].fd = ports[i];
+    fds[i].events = POLLIN;
+  }
+  while (true) {
+    int wait = (int)((deadline - seconds()) * 1000);
+    if (wait <= 0 || poll(fds, portCount, wait) <= 0) {
+      return false;
+    }
+    for (int i = 0; i < portCount; i++) {
+      if (fds[i].revents & POLLIN) {
+        ssize_t n = read(ports[i], frame + length, size - length);
+        length += n > 0 ? n : 0;
+      }
+    }
+    if (frame[0] == address && isValidFrame(frame, length)) {
+      return length;
+    }
+    if (length == size) {
+      return 0; // garbage, try again on the next round
+    }
+  }
+}
+
+// Wait up to REPLY_TIMEOUT_MS for a status frame from address.
+bool receiveStatus(unsigned char address, PowerStatus &status) {
+  unsigned char frame[64];
+  int length = receiveReply(address, frame, sizeof(frame));
+  if (!isPowerStatus(frame, length)) {
+    return false;
+  }
+  status = readPowerStatus(frame);
+  return true;
+}
+
+long powerInUse() {
+  long used = 0;
+  for (int i = 0; i < options.nodes; i++) {
+    used += nodes[i].granted ? nodes[i].status.watts : 0;
+  }
+  return used;
+}
+
+bool isWaiting(const Node &node) {
+  return node.seen && (node.status.flags & POWER_WANTS) && !node.granted;
+}
+
+// Who goes first among the waiting: anyone starved, then the shortest expected heating, then the longest waiting.
+bool goesBefore(const Node &a, const Node &b, double now) {
+  bool aStarved = now - a.waitingSince > options.maxWait;
+  bool bStarved = now - b.waitingSince > options.maxWait;
+  if (aStarved != bStarved) {
+    return aStarved;
+  }
+  if (!aStarved && a.status.remaining != b.status.remaining) {
+    return a.status.remaining < b.status.remaining;
+  }
+  return a.waitingSince < b.waitingSince;
+}
+
+// Hand out what is left under the cap, in order, skipping the ones that don't fit.
+void allocate() {
+  double now = seconds();
+  long free = options.cap - powerInUse();
+  Node *order[MAX_NODES];
+  int count = 0;
+  for (int i = 0; i < options.nodes; i++) {
+    if (!isWaiting(nodes[i])) {
+      continue;
+    }
+    if (nodes[i].status.watts > options.cap) {
+      if (!nodes[i].tooBig) {
+        note("node %d needs %u W, more than the cap", nodes[i].address, nodes[i].status.watts);
+        nodes[i].tooBig = true;
+      }
+      continue;
+    }
+    int j = count++;
+    while (j > 0 && goesBefore(nodes[i], *order[j - 1], now)) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = &nodes[i];
+  }
+  for (int i = 0; i < count; i++) {
+    if (order[i]->status.watts <= free) {
+      order[i]->granted = true;
+      free -= order[i]->status.watts;
+      note("grant node %d: %u W after %.0f s waiting, %ld of %ld W in use", order[i]->address,
+           order[i]->status.watts, now - order[i]->waitingSince, options.cap - free, options.cap);
+    }
+  }
+}
+
+void update(Node &node, const PowerStatus &status) {
+  double now = seconds();
+  if (!node.seen) {
+    note("node %d online", node.address);
+  }
+  node.seen = true;
+  node.lastSeen = now;
+  node.status = status;
+  if (status.flags & POWER_HOLDS) {
+    node.granted = true; // granted before we started, or heating on its own before we showed up
+  } else if (!(status.flags & POWER_WANTS) && node.granted) {
+    node.granted = false;
+    note("node %d released %u W", node.address, status.watts);
+  }
+  if ((status.flags & POWER_WANTS) && !node.granted) {
+    node.waitingSince = node.waitingSince > 0 ? node.waitingSince : now;
+  } else {
+    node.waitingSince = 0;
+  }
+}
+
+void pollNode(Node &node) {
+  unsigned char frame[POWER_POLL_LENGTH];
+  discardInput();
+  send(frame, powerPoll(frame, node.address, node.granted && seconds() - node.lastSeen < GRANT_RENEWAL));
+  PowerStatus status;
+  if (receiveStatus(node.address, status)) {
+    update(node, status);
+  } else if (node.seen && seconds() - node.lastSeen > OFFLINE_RELEASE) {
+    note("node %d offline", node.address);
+    node.seen = false;
+    node.granted = false;
+    node.waitingSince = 0;
+  }
+}
+
+void openModbus() {
+  if (!strcmp(options.modbus, "pty")) {
+    modbusFd = openPty();
+    makeRaw(modbusFd, 0);
+    printf("modbus: %s\n", ptsname(modbusFd));
+    fflush(stdout);
+    return;
+  }
+  modbusFd = openSerial(options.modbus, options.baud);
+}
+
+// Pass a request from the building management system on to the bus, once it is all in, and its reply back.
+// Register requests are complete once their length is known, anything else after a few milliseconds of silence.
+void serveModbus() {
+  if (modbusFd < 0) {
+    return;
+  }
+  ssize_t n = read(modbusFd, request + requestLength, sizeof(request) - requestLength);
+  if (n > 0) {
+    requestLength += n;
+    requestTime = seconds();
+  }
+  if (requestLength == 0) {
+    return;
+  }
+  int expected = modbusRequestLength(request, requestLength);
+  if (requestLength < expected || (expected == 0 && seconds() - requestTime < MODBUS_GAP_MS / 1000.0)) {
+    return;
+  }
+  int length = requestLength;
+  requestLength = 0;
+  if ((expected > 0 && length != expected) || !isValidFrame(request, length)) {
+    return;
+  }
+  usleep(POLL_GAP_MS * 1000); // right after a poll and its reply
+  discardInput();
+  send(request, length);
+  if (request[0] == MODBUS_BROADCAST) {
+    return;
+  }
+  unsigned char reply[256];
+  int replyLength = receiveReply(request[0], reply, sizeof(reply));
+  if (replyLength > 0 && write(modbusFd, reply, replyLength) < 0) {
+    // the building management system went away, it asks again when back
+  }
+}
+
+void parseOptions(int argc, char **argv) {
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--cap") && i + 1 < argc) {
+      options.cap = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "--nodes") && i + 1 < argc) {
+      options.nodes = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "--port") && i + 1 < argc) {
+      options.port = argv[++i];
+    } else if (!strcmp(argv[i], "--baud") && i + 1 < argc) {
+      options.baud = atol(argv[++i]);
+    } else if (!strcmp(argv[i], "--pty")) {
+      options.pty = true;
+    } else if (!strcmp(argv[i], "--max-wait") && i + 1 < argc) {
+      options.maxWait = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "--modbus") && i + 1 < argc) {
+      options.modbus = argv[++i];
+    } else {
+      options.cap = 0;
+      break;
+    }
+  }
+  if (options.cap <= 0 || options.nodes < 1 || options.nodes > MAX_NODES || (options.port == nullptr) == !options.pty) {
+    fprintf(stderr, "usage: %s --cap WATTS --nodes COUNT (--port DEVICE [--baud BAUD] | --pty) [--max-wait SECONDS] [--modbus DEVICE]\n", argv[0]);
+    exit(2);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  parseOptions(argc, argv);
+  if (options.pty) {
+    openNodePtys();
+  } else {
+    ports[portCount++] = openSerial(options.port, options.baud);
+  }
+  if (options.modbus) {
+    openModbus();
+  }
+  for (int i = 0; i < options.nodes; i++) {
+    nodes[i].address = i + 1;
+  }
+  note("coordinating %d nodes under %ld W", options.nodes, options.cap);
+  while (true) {
+    for (int i = 0; i < options.nodes; i++) {
+      pollNode(nodes[i]);
+      allocate();
+      serveModbus();
+      usleep(POLL_GAP_MS * 1000);
+    }
+  }
+}
@@ -0,0 +1,126 @@
+#ifndef SERIAL_UTIL_H
+#define SERIAL_UTIL_H
+
+// Serial ports, pseudo terminals and logging shared by the host tools. Host only, Linux.
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+inline double seconds() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A line on stdout, with the time of day in front.
+inline void note(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+inline void note(const char *format, ...) {
+  time_t t = time(nullptr);
+  char stamp[16];
+  strftime(stamp, sizeof(stamp), "%H:%M:%S", localtime(&t));
+  printf("%s ", stamp);
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf("\n");
+  fflush(stdout);
+}
+
+inline speed_t baudConstant(long baud) {
+  switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+  }
+  fprintf(stderr, "unsupported baud rate %ld\n", baud);
+  exit(2);
+}
+
+// No echo and no line editing, at baud unless it is 0 (pseudo terminals don't have one).
+inline void makeRaw(int fd, long baud) {
+  termios tio;
+  if (tcgetattr(fd, &tio) != 0) {
+    return;
+  }
+  cfmakeraw(&tio);
+  if (baud) {
+    cfsetspeed(&tio, baudConstant(baud));
+  }
+  tcsetattr(fd, TCSANOW, &tio);
+}
+
+// Serial port, raw at baud, non-blocking. Exits if it can't be opened.
+inline int openSerial(const char *device, long baud) {
+  int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0) {
+    perror(device);
+    exit(2);
+  }
+  makeRaw(fd, baud);
+  return fd;
+}
+
+// Master end of a new pseudo terminal, non-blocking, ptsname() names the other end. Exits if none is left.
+inline int openPty() {
+  int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+    perror("posix_openpt");
+    exit(2);
+  }
+  return fd;
+}
+
+inline void watch(int epollFd, int fd, uint32_t events, uint32_t tag) {
+  epoll_event event;
+  event.events = events;
+  event.data.u32 = tag;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+    perror("epoll_ctl");
+    exit(2);
+  }
+}
+
+// Telemetry ports of the controllers, Controller having name, device, fd and slaveFd.
+template <class Controller>
+void openPorts(Controller *controllers, int count, long baud) {
+  for (int i = 0; i < count; i++) {
+    controllers[i].fd = openSerial(controllers[i].device, baud);
+    controllers[i].slaveFd = -1;
+  }
+}
+
+// Controllers 1 to count on pseudo terminals, printed as they are made. Our own open slave end keeps the master
+// from hanging up whenever a controller goes away, and keeps commands going down from being echoed back.
+template <class Controller>
+void openPtys(Controller *controllers, int count) {
+  for (int i = 0; i < count; i++) {
+    Controller &c = controllers[i];
+    char name[12];
+    snprintf(name, sizeof(name), "%d", i + 1);
+    c.name = strdup(name);
+    c.fd = openPty();
+    c.device = strdup(ptsname(c.fd));
+    c.slaveFd = open(c.device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (c.slaveFd < 0) {
+      perror(c.device);
+      exit(2);
+    }
+    makeRaw(c.slaveFd, 0);
+    printf("controller %s: %s\n", c.name, c.device);
+  }
+  fflush(stdout);
+}
+
+#endif
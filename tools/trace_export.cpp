@@ -0,0 +1,207 @@
+// Chrome / Perfetto trace of program timelines, from recorded telemetry or simulator output.
+//
+//   trace_export [FILE ...] > trace.json
+//
+// Reads telemetry lines ("T <millis> <name> <value>", as captured from a telemetry port) and simulator output
+// (dishwasher --verbose, which has the beeps too) from the files, stdin without any, and writes trace-event JSON
+// for ui.perfetto.dev or chrome://tracing. Every file is a process with a track for the program phase, the state,
+// each output, the beeper, the door and the gaps: times in a program phase with every output off, seconds nothing
+// happens.
+//
+// Outputs and states come from the "state" and "outputs" lines (see include/status.h), so they are as precise as
+// the control tick. Recorded telemetry has no beeps, only the simulator prints them.
+//
+// Build with: g++ -std=gnu++11 -O2 -Wall -Iinclude tools/trace_export.cpp -o trace_export
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "status.h"
+
+namespace {
+
+enum Track {
+  TRACK_PHASE = 1,
+  TRACK_STATE,
+  TRACK_GAPS,
+  TRACK_BEEPER,
+  TRACK_DOOR,
+  TRACK_OUTPUTS, // one per output from here on
+  TRACK_COUNT = TRACK_OUTPUTS + OUTPUT_COUNT
+};
+
+struct Slice {
+  const char *name; // nullptr while nothing is going on
+  unsigned long long since;
+};
+
+// Timeline of one file, in microseconds.
+struct Timeline {
+  int pid;
+  Slice open[TRACK_COUNT];
+  int state;
+  unsigned outputs;
+  unsigned long lastMillis;
+  unsigned long long offset; // the controller restarted, keep time going
+  unsigned long long now;
+};
+
+bool firstEvent = true;
+
+void event(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+void event(const char *format, ...) {
+  printf(firstEvent ? "\n  " : ",\n  ");
+  firstEvent = false;
+  va_list args;
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+}
+
+// JSON string contents, file names can have anything in them.
+void putEscaped(const char *text) {
+  for (; *text; text++) {
+    if (*text == '"' || *text == '\\') {
+      printf("\\%c", *text);
+    } else if ((unsigned char)*text < 0x20) {
+      printf("\\u%04x", *text);
+    } else {
+      putchar(*text);
+    }
+  }
+}
+
+void trackName(int pid, int tid, const char *name) {
+  event("{\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}", pid, tid, name);
+  event("{\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"name\":\"thread_sort_index\",\"args\":{\"sort_index\":%d}}", pid, tid,
+        tid);
+}
+
+void describe(const Timeline &t, const char *source) {
+  event("{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"", t.pid);
+  putEscaped(source);
+  printf("\"}}");
+  trackName(t.pid, TRACK_PHASE, "phase");
+  trackName(t.pid, TRACK_STATE, "state");
+  trackName(t.pid, TRACK_GAPS, "gaps");
+  trackName(t.pid, TRACK_BEEPER, "beeper");
+  trackName(t.pid, TRACK_DOOR, "door");
+  for (unsigned i = 0; i < OUTPUT_COUNT; i++) {
+    trackName(t.pid, TRACK_OUTPUTS + i, OUTPUT_NAMES[i]);
+  }
+}
+
+void slice(const Timeline &t, int track, const char *name, unsigned long long since, unsigned long long until) {
+  event("{\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"name\":\"%s\",\"ts\":%llu,\"dur\":%llu}", t.pid, track, name, since,
+        until - since);
+}
+
+// Close what is going on in a track and start something else, nullptr for nothing.
+void change(Timeline &t, int track, const char *name) {
+  Slice &s = t.open[track];
+  if (s.name == name || (s.name && name && !strcmp(s.name, name))) {
+    return;
+  }
+  if (s.name && t.now > s.since) {
+    slice(t, track, s.name, s.since, t.now);
+  }
+  s.name = name;
+  s.since = t.now;
+}
+
+const char *phaseOf(int state) {
+  return state >= 0 && state < STATE_COUNT ? STATE_PHASES[state] : nullptr;
+}
+
+void updateGaps(Timeline &t) {
+  change(t, TRACK_GAPS, phaseOf(t.state) && t.outputs == 0 ? "no output" : nullptr);
+}
+
+void closeAll(Timeline &t) {
+  for (int track = 0; track < TRACK_COUNT; track++) {
+    change(t, track, nullptr);
+  }
+}
+
+void advance(Timeline &t, unsigned long millis) {
+  if (millis < t.lastMillis) {
+    closeAll(t); // restarted, nothing carries over
+    t.offset += t.lastMillis;
+    t.state = -1;
+    t.outputs = 0;
+  }
+  t.lastMillis = millis;
+  t.now = (t.offset + millis) * 1000ULL;
+}
+
+void telemetryLine(Timeline &t, unsigned long millis, const char *name, const char *value) {
+  advance(t, millis);
+  if (!strcmp(name, "state")) {
+    t.state = atoi(value);
+    change(t, TRACK_STATE, t.state >= 0 && t.state < STATE_COUNT ? STATE_NAMES[t.state] : "unknown");
+    change(t, TRACK_PHASE, phaseOf(t.state));
+    updateGaps(t);
+  } else if (!strcmp(name, "outputs")) {
+    t.outputs = atoi(value);
+    for (unsigned i = 0; i < OUTPUT_COUNT; i++) {
+      change(t, TRACK_OUTPUTS + i, t.outputs >> i & 1 ? OUTPUT_NAMES[i] : nullptr);
+    }
+    updateGaps(t);
+  } else if (!strcmp(name, "door")) {
+    change(t, TRACK_DOOR, strcmp(value, "open") ? nullptr : "open");
+  }
+}
+
+// "   12.345 beep 80 ms" from the simulator, seconds of simulated time, the same clock as the telemetry.
+void beepLine(Timeline &t, double seconds, unsigned long length) {
+  unsigned long millis = (unsigned long)(seconds * 1000 + 0.5);
+  if (millis < t.lastMillis) {
+    return; // printed before the telemetry of the same tick caught up, or from before a restart
+  }
+  advance(t, millis);
+  slice(t, TRACK_BEEPER, "beep", t.now, t.now + length * 1000ULL);
+}
+
+void exportFile(FILE *input, const char *source, int pid) {
+  Timeline t;
+  memset(&t, 0, sizeof(t));
+  t.pid = pid;
+  t.state = -1;
+  describe(t, source);
+  char line[256];
+  while (fgets(line, sizeof(line), input)) {
+    unsigned long millis;
+    char name[32];
+    char value[64];
+    double seconds;
+    unsigned long length;
+    if (sscanf(line, "T %lu %31s %63s", &millis, name, value) == 3) {
+      telemetryLine(t, millis, name, value);
+    } else if (sscanf(line, "%lf beep %lu ms", &seconds, &length) == 2) {
+      beepLine(t, seconds, length);
+    }
+  }
+  closeAll(t);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  if (argc < 2) {
+    exportFile(stdin, "dishwasher", 1);
+  }
+  for (int i = 1; i < argc; i++) {
+    FILE *input = fopen(argv[i], "r");
+    if (!input) {
+      perror(argv[i]);
+      return 2;
+    }
+    exportFile(input, argv[i], i);
+    fclose(input);
+  }
+  printf("\n]}\n");
+  return 0;
+}